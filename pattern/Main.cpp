@@ -1,19 +1,86 @@
 ﻿#include <iostream>
 #include <cassert>
 #include <string> 
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <list>
+#include <deque>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstddef>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Компилятор не сливает a * b + c в одну инструкцию fma: результат не зависит от того, есть ли fma у машины
+// и с какими -march собрано (явные std::fma, как в double-double, остаются). -DEXPRESSION_FP_CONTRACT разрешает слияние.
+#ifndef EXPRESSION_FP_CONTRACT
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+#endif
 
 struct Transformer;
 struct Number;
 struct BinaryOperation;
 struct FunctionCall;
 struct Variable;
+struct Let;
+struct Reduction;
+struct Program;
 
 struct Expression { //базовая абстрактная структура
 	virtual ~Expression() { } //виртуальный деструктор
 
+	// Внутри RequestScope узлы берутся из арены запроса, иначе из кучи (см. RequestScope).
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+	static void dispose(Expression const* child); // удаление потомка в деструкторе узла (см. RequestScope и Arena)
+
 	virtual double evaluate() const = 0; //абстрактный метод «вычислить»
 	virtual Expression* transform(Transformer* tr) const = 0;
 	virtual std::string print() const = 0;//абстрактный метод печать
+	// Держит ли узел память вне себя: имя длиннее встроенного буфера строки, вектор аргументов, программы свёртки.
+	// Арена вызывает деструкторы только таких своих узлов, остальные при откате просто забываются.
+	virtual bool holds() const { return false; }
+
+protected:
+	// Вызывается в конце конструктора. Узел открытой RequestScope, который держит память вне себя (holds)
+	// или потомка из кучи (children), записывается на вызов деструктора при закрытии области.
+	void track(bool children = false) const;
+	static bool outside(Expression const* child); // внутри области: потомок лежит не в её арене
+	static bool heap(std::string const& s) { // символы строки лежат не в ней самой
+		char const* data = s.data();
+		char const* self = reinterpret_cast<char const*>(&s);
+		return std::less<char const*>()(data, self) || !std::less<char const*>()(data, self + sizeof s);
+	}
 };
 
 
@@ -24,6 +91,42 @@ struct Transformer { //pattern Visitor
 	virtual Expression* transformBinaryOperation(BinaryOperation const*) = 0;
 	virtual Expression* transformFunctionCall(FunctionCall const*) = 0;
 	virtual Expression* transformVariable(Variable const*) = 0;
+	virtual Expression* transformLet(Let const*) = 0;
+	virtual Expression* transformReduction(Reduction const*) = 0;
+};
+
+
+struct Environment { // значения имён, связанных let, на время рекурсивного evaluate (свои в каждом потоке)
+	static std::vector<std::pair<std::string, double>>& bindings() {
+		thread_local std::vector<std::pair<std::string, double>> bindings;
+		return bindings;
+	}
+	static bool lookup(std::string const& name, double& value) { // ближайшая по вложенности привязка
+		std::vector<std::pair<std::string, double>> const& b = bindings();
+		for (size_t i = b.size(); i-- > 0; )
+			if (b[i].first == name) {
+				value = b[i].second;
+				return true;
+			}
+		return false;
+	}
+	// Массивы для свёрток: внутри тела Reduction имя массива означает его текущий элемент.
+	struct Array {
+		std::string name;
+		double const* data;
+		size_t size;
+	};
+	static std::vector<Array>& arrays() {
+		thread_local std::vector<Array> arrays;
+		return arrays;
+	}
+	static Array const* lookupArray(std::string const& name) {
+		std::vector<Array> const& a = arrays();
+		for (size_t i = a.size(); i-- > 0; )
+			if (a[i].name == name)
+				return &a[i];
+		return nullptr;
+	}
 };
 
 
@@ -44,10 +147,13 @@ private:
 
 struct BinaryOperation : Expression { // «Бинарная операция»
 public:
-	BinaryOperation(Expression const* left, int op, Expression const* right) : left_(left), op_(op), right_(right) { assert(left_ && right_); }
+	BinaryOperation(Expression const* left, int op, Expression const* right) : left_(left), op_(op), right_(right) {
+		assert(left_ && right_);
+		track(outside(left_) || outside(right_));
+	}
 	~BinaryOperation() {
-		delete left_;
-		delete right_;
+		dispose(left_);
+		dispose(right_);
 	}
 
 	enum {
@@ -79,44 +185,421 @@ private:
 };
 
 
+// Кривая, заданная таблицей: возрастающие узлы, значения в них и линейная или кубическая (Эрмит с наклонами
+// по соседним узлам) интерполяция. За краями таблицы значение продолжается константой, производные равны 0.
+// Отрезок ищется без ветвлений: прямым индексом, если узлы равномерны, иначе спуском по узлам в порядке
+// Эйтцингера с фиксированным числом шагов. Пакетный вариант сначала находит отрезки для куска строк,
+// затем одним циклом считает многочлены a + bt + ct^2 + dt^3 на отрезках.
+struct Table {
+public:
+	enum { LINEAR, CUBIC };
+	enum { CHUNK = 256 }; // строк на кусок в пакетном вычислении
+
+	Table(std::vector<double> const& knots, std::vector<double> const& values, int interpolation)
+		: knots_(knots), order_(0), uniform_(true), levels_(0) {
+		size_t n = knots.size();
+		assert(n >= 2 && values.size() == n);
+		assert(interpolation == LINEAR || interpolation == CUBIC);
+		for (size_t i = 1; i < n; ++i)
+			assert(knots[i - 1] < knots[i]);
+		std::vector<double> slopes(n, 0.0);
+		if (interpolation == CUBIC)
+			for (size_t i = 0; i < n; ++i) {
+				size_t l = i > 0 ? i - 1 : 0, r = std::min(i + 1, n - 1);
+				slopes[i] = (values[r] - values[l]) / (knots[r] - knots[l]);
+			}
+		for (size_t j = 0; j + 1 < n; ++j) {
+			double h = knots[j + 1] - knots[j], v0 = values[j], v1 = values[j + 1];
+			double m0 = slopes[j] * h, m1 = slopes[j + 1] * h;
+			a_.push_back(v0);
+			if (interpolation == LINEAR) {
+				b_.push_back(v1 - v0);
+				c_.push_back(0.0);
+				d_.push_back(0.0);
+			}
+			else {
+				b_.push_back(m0);
+				c_.push_back(3.0 * (v1 - v0) - 2.0 * m0 - m1);
+				d_.push_back(2.0 * (v0 - v1) + m0 + m1);
+			}
+		}
+		origin_ = knots[0];
+		double step = (knots[n - 1] - knots[0]) / double(n - 1);
+		inverseStep_ = 1.0 / step;
+		for (size_t i = 0; i < n; ++i)
+			uniform_ = uniform_ && std::fabs(knots[i] - (origin_ + double(i) * step)) <= 1e-9 * step;
+		if (!uniform_) { // полное дерево из 2^levels - 1 узлов, хвост дополнен +inf
+			while ((size_t(1) << levels_) - 1 < n)
+				++levels_;
+			eytzinger_.assign(size_t(1) << levels_, std::numeric_limits<double>::infinity());
+			size_t i = 0;
+			layout(1, i);
+		}
+	}
+
+	int order() const { return order_; } // порядок производной, которую считает таблица
+	std::shared_ptr<Table const> derivative() const { // те же отрезки, следующий порядок производной
+		std::shared_ptr<Table> table = std::make_shared<Table>(*this);
+		++table->order_;
+		return table;
+	}
+	double evaluate(double x) const {
+		double out;
+		evaluate(&x, 1, &out);
+		return out;
+	}
+	void evaluate(double const* x, size_t n, double* out) const {
+		size_t segments = a_.size();
+		size_t index[CHUNK];
+		for (size_t base = 0; base < n; base += CHUNK) {
+			size_t m = std::min<size_t>(CHUNK, n - base);
+			double const* xs = x + base;
+			if (uniform_) {
+				double last = double(segments - 1);
+				for (size_t i = 0; i < m; ++i) {
+					double f = (xs[i] - origin_) * inverseStep_;
+					f = f > 0.0 ? f : 0.0; // NaN попадает в первый отрезок, а результат для него — NaN (см. ниже)
+					f = f < last ? f : last;
+					index[i] = size_t(f);
+				}
+			}
+			else {
+				for (size_t i = 0; i < m; ++i)
+					index[i] = 1;
+				for (int level = 0; level < levels_; ++level) // все строки спускаются одинаковое число шагов
+					for (size_t i = 0; i < m; ++i)
+						index[i] = 2 * index[i] + (eytzinger_[index[i]] <= xs[i]);
+				for (size_t i = 0; i < m; ++i) { // биты пути — число узлов не больше x
+					size_t count = index[i] - (size_t(1) << levels_);
+					count = count > 0 ? count - 1 : 0;
+					index[i] = count < segments - 1 ? count : segments - 1;
+				}
+			}
+			for (size_t i = 0; i < m; ++i) {
+				size_t j = index[i];
+				double h = knots_[j + 1] - knots_[j];
+				double t = (xs[i] - knots_[j]) / h;
+				double clamped = t > 0.0 ? (t < 1.0 ? t : 1.0) : 0.0; // NaN прижался бы к 0 и скрыл ошибку области
+				double value = segment(j, clamped, h) * (order_ == 0 || clamped == t ? 1.0 : 0.0);
+				out[base + i] = t == t ? value : t;
+			}
+		}
+	}
+
+private:
+	void layout(size_t k, size_t& i) { // симметричный обход полного дерева раздаёт узлы по возрастанию
+		if (k >= eytzinger_.size())
+			return;
+		layout(2 * k, i);
+		if (i < knots_.size())
+			eytzinger_[k] = knots_[i];
+		++i;
+		layout(2 * k + 1, i);
+	}
+	double segment(size_t j, double t, double h) const { // производная порядка order_ многочлена отрезка j
+		switch (order_) {
+		case 0: return a_[j] + t * (b_[j] + t * (c_[j] + t * d_[j]));
+		case 1: return (b_[j] + t * (2.0 * c_[j] + t * 3.0 * d_[j])) / h;
+		case 2: return (2.0 * c_[j] + t * 6.0 * d_[j]) / (h * h);
+		case 3: return 6.0 * d_[j] / (h * h * h);
+		default: return 0.0;
+		}
+	}
+
+	std::vector<double> knots_;
+	std::vector<double> a_, b_, c_, d_; // коэффициенты по t = (x - knots_[j]) / h на каждом отрезке
+	int order_;
+	bool uniform_;
+	double origin_;
+	double inverseStep_;
+	int levels_;
+	std::vector<double> eytzinger_; // узлы в порядке Эйтцингера с 1; используется для неравномерных узлов
+};
+
+
+struct FunctionRegistry { // пользовательские функции: имя -> параметры и тело-выражение над ними
+public:
+	struct Definition {
+		std::vector<std::string> params;
+		Expression const* body; // пусто у таблиц
+		size_t cost; // число узлов тела с учётом встраивания вызываемых функций
+		mutable std::shared_ptr<Program const> kernel; // общее ядро; компилируется при первом невстроенном вызове
+		std::shared_ptr<Table const> table; // функция одного аргумента, заданная таблицей
+	};
+
+	static FunctionRegistry& instance() {
+		static FunctionRegistry registry;
+		return registry;
+	}
+	~FunctionRegistry() {
+		for (auto& definition : definitions_)
+			delete definition.second->body;
+	}
+
+	// Регистрирует функцию и забирает body во владение. Тело может ссылаться только на свои параметры
+	// и на уже определённые функции, поэтому рекурсия невозможна, а переопределение запрещено.
+	// Свёртки в теле не допускаются, нужен хотя бы один параметр. При ошибке возвращает false, и body остаётся у вызывающего.
+	// Тело из открытой RequestScope копируется в кучу, а само остаётся области.
+	// Имена со штрихом зарезервированы за производными таблиц (см. derivative).
+	bool define(std::string const& name, std::vector<std::string> const& params, Expression const* body);
+	bool defineTable(std::string const& name, std::shared_ptr<Table const> const& table) { // вызов name(x) интерполирует таблицу
+		if (!table || builtin(name) || reserved(name))
+			return false;
+		return publish(name, std::unique_ptr<Definition>(new Definition{ std::vector<std::string>(1, "x"), nullptr, 1, nullptr, table }));
+	}
+	// Имя таблицы производной для таблицы name: name + "'". Такие имена пользователю недоступны, а таблицы
+	// не переопределяются, поэтому уже зарегистрированная запись — производная именно этой таблицы.
+	std::string derivative(std::string const& name) {
+		Definition const* definition = find(name);
+		assert(definition && definition->table);
+		std::string result = name + "'";
+		if (!find(result)) // при гонке запись публикует один поток, остальные получат false от publish
+			publish(result, std::unique_ptr<Definition>(new Definition{ definition->params, nullptr, 1, nullptr, definition->table->derivative() }));
+		return result;
+	}
+	static bool builtin(std::string const& name) { return name == "sqrt" || name == "abs"; }
+	static bool reserved(std::string const& name) { return name.empty() || name.find('\'') != std::string::npos; }
+	// Без блокировки: читается неизменяемый снимок, который define заменяет целиком.
+	Definition const* find(std::string const& name) const {
+		Index const* index = index_.load(std::memory_order_acquire);
+		auto it = index->find(name);
+		return it == index->end() ? nullptr : it->second;
+	}
+	std::shared_ptr<Program const> kernel(Definition const* definition) const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return definition->kernel;
+	}
+	// Сохраняет ядро, если его ещё нет; при гонке двух компиляций остаётся первое.
+	std::shared_ptr<Program const> setKernel(Definition const* definition, std::shared_ptr<Program const> const& kernel) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!definition->kernel)
+			definition->kernel = kernel;
+		return definition->kernel;
+	}
+
+private:
+	typedef std::unordered_map<std::string, Definition const*> Index;
+
+	FunctionRegistry() {
+		snapshots_.emplace_back(new Index());
+		index_.store(snapshots_.back().get(), std::memory_order_release);
+	}
+	static bool check(Expression const* expr, std::vector<std::string>& scope, size_t& cost);
+	// Новая функция попадает в копию снимка, которая затем публикуется. Старые снимки живут до конца программы:
+	// их ещё могут читать другие потоки, а функций обычно единицы, так что копирование дёшево.
+	bool publish(std::string const& name, std::unique_ptr<Definition> definition) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		Definition const* published = definition.get();
+		if (!definitions_.emplace(name, std::move(definition)).second)
+			return false;
+		std::unique_ptr<Index> index(new Index(*index_.load(std::memory_order_relaxed)));
+		(*index)[name] = published;
+		index_.store(index.get(), std::memory_order_release);
+		snapshots_.push_back(std::move(index));
+		return true;
+	}
+
+	mutable std::mutex mutex_; // запись в реестр и ядра
+	std::unordered_map<std::string, std::unique_ptr<Definition>> definitions_;
+	std::vector<std::unique_ptr<Index const>> snapshots_;
+	std::atomic<Index const*> index_; // текущий снимок для find
+};
+
+
 struct FunctionCall : Expression {
 public:
-	FunctionCall(std::string const& name, Expression const* arg) : name_(name), arg_(arg) {
+	FunctionCall(std::string const& name, Expression const* arg)
+		: name_(name), arg_(arg), definition_(FunctionRegistry::builtin(name) ? nullptr : FunctionRegistry::instance().find(name)) {
 		assert(arg_);
-		assert(name_ == "sqrt" || name_ == "abs");
-	} // разрешены только вызов sqrt и abs
-	~FunctionCall() { delete arg_; } // освобождаем память в деструкторе
+		assert(name_ == "sqrt" || name_ == "abs" || (definition_ && definition_->params.size() == 1));
+		track(outside(arg_));
+	} // встроенные sqrt и abs либо функция из реестра
+	FunctionCall(std::string const& name, std::vector<Expression const*> const& args)
+		: name_(name), arg_(args.empty() ? nullptr : args[0]),
+		definition_(FunctionRegistry::builtin(name) ? nullptr : FunctionRegistry::instance().find(name)) {
+		assert(arg_);
+		rest_.assign(args.begin() + 1, args.end());
+		bool children = outside(arg_);
+		for (Expression const* arg : rest_) {
+			assert(arg);
+			children = children || outside(arg);
+		}
+		assert(definition_ ? definition_->params.size() == args.size() : args.size() == 1 && (name_ == "sqrt" || name_ == "abs"));
+		track(children);
+	}
+	~FunctionCall() { // освобождаем память в деструкторе
+		dispose(arg_);
+		for (Expression const* arg : rest_)
+			dispose(arg);
+	}
 
 	std::string const& name() const { return name_; }
 	Expression const* arg() const { return arg_; }// чтение аргумента функции
+	// Второй и следующие аргументы лежат отдельно: у одноаргументных вызовов вектор пуст и не занимает кучу,
+	// и арене не нужно вызывать деструктор такого узла (см. holds).
+	size_t arity() const { return 1 + rest_.size(); }
+	Expression const* arg(size_t i) const { return i == 0 ? arg_ : rest_[i - 1]; }
+	FunctionRegistry::Definition const* definition() const { return definition_; } // пусто для sqrt и abs
 	virtual double evaluate() const { // реализация виртуального метода «вычислить»
+		if (definition_ && definition_->table)
+			return definition_->table->evaluate(arg_->evaluate());
+		if (definition_) { // тело видит только свои параметры, поэтому достаточно положить их поверх окружения
+			std::vector<std::pair<std::string, double>>& bindings = Environment::bindings();
+			std::vector<double> values;
+			for (size_t i = 0; i < arity(); ++i)
+				values.push_back(arg(i)->evaluate());
+			for (size_t i = 0; i < values.size(); ++i)
+				bindings.emplace_back(definition_->params[i], values[i]);
+			double result = definition_->body->evaluate();
+			bindings.resize(bindings.size() - values.size());
+			return result;
+		}
 		if (name_ == "sqrt")
 			return sqrt(arg_->evaluate()); // либо вычисляем корень квадратный
 		return fabs(arg_->evaluate());
-	} // либо модуль — остальные функции запрещены
-	std::string print() const { return this->name_ + "(" + this->arg_->print() + ")"; }
+	} // либо модуль
+	std::string print() const {
+		std::string result = this->name_ + "(" + this->arg_->print();
+		for (Expression const* arg : rest_)
+			result += ", " + arg->print();
+		return result + ")";
+	}
 	Expression* transform(Transformer* tr) const { return tr->transformFunctionCall(this); }
+	bool holds() const { return heap(name_) || rest_.capacity() > 0; }
 
 private:
 	std::string const name_;
 	Expression const* arg_;
+	std::vector<Expression const*> rest_;
+	FunctionRegistry::Definition const* definition_;
 };
 
 
 struct Variable : Expression { 
 public:
-	Variable(std::string const& name) : name_(name) {}
+	Variable(std::string const& name) : name_(name) { track(); }
 
 	std::string const& name() const { return name_; } // чтение имени переменной
-	double evaluate() const { return 0.0; } // реализация виртуального метода «вычислить»
+	double evaluate() const { // значение из объемлющего let, иначе 0
+		double value = 0.0;
+		Environment::lookup(name_, value);
+		return value;
+	}
 	std::string print() const { return this->name_; }
 	Expression* transform(Transformer* tr) const { return tr->transformVariable(this); }
+	bool holds() const { return heap(name_); }
 
 private:
 	std::string const name_; // имя переменной
 };
 
 
+struct Let : Expression { // let name = value in body: value вычисляется один раз, а в body на него ссылаются через Variable(name)
+public:
+	Let(std::string const& name, Expression const* value, Expression const* body) : name_(name), value_(value), body_(body) {
+		assert(value_ && body_);
+		track(outside(value_) || outside(body_));
+	}
+	~Let() {
+		dispose(value_);
+		dispose(body_);
+	}
+
+	std::string const& name() const { return name_; }
+	Expression const* value() const { return value_; }
+	Expression const* body() const { return body_; }
+	double evaluate() const {
+		std::vector<std::pair<std::string, double>>& bindings = Environment::bindings();
+		bindings.emplace_back(name_, value_->evaluate());
+		double result = body_->evaluate();
+		bindings.pop_back();
+		return result;
+	}
+	std::string print() const { return "(let " + this->name_ + " = " + this->value_->print() + " in " + this->body_->print() + ")"; }
+	Expression* transform(Transformer* tr) const { return tr->transformLet(this); }
+	bool holds() const { return heap(name_); }
+
+private:
+	std::string const name_;
+	Expression const* value_;
+	Expression const* body_;
+};
+
+
+// Свёртка массива в число. Тело вычисляется поэлементно: имя из Environment::arrays() означает i-й элемент
+// массива, прочие имена — скалярные привязки Environment (без привязки 0). Все массивы тела должны быть
+// одной длины; тело без массивов сворачивает пустую последовательность.
+// Тело компилируется один раз в конструкторе и считается блоками, как пакетная программа, поэтому
+// сумма тысячи слагаемых — один узел, а не цепочка из тысячи BinaryOperation.
+struct Reduction : Expression {
+public:
+	enum {
+		SUM = 'S',
+		DOT = 'D', // сумма произведений двух тел
+		NORM = 'N', // евклидова норма
+		MIN = 'm',
+		MAX = 'M'
+	};
+
+	Reduction(int kind, Expression const* arg);
+	Reduction(int kind, Expression const* left, Expression const* right); // только DOT
+	~Reduction() {
+		dispose(left_);
+		dispose(right_);
+	}
+
+	int kind() const { return kind_; }
+	Expression const* arg() const { return left_; }
+	Expression const* right() const { return right_; } // второе тело DOT, иначе пусто
+	std::shared_ptr<Program const> const& program() const { return program_; }
+	std::shared_ptr<Program const> const& rightProgram() const { return rightProgram_; }
+	double evaluate() const { return reduce(kind_, *program_, rightProgram_.get()); }
+	std::string print() const {
+		std::string name = kind_ == SUM ? "sum" : kind_ == DOT ? "dot" : kind_ == NORM ? "norm" : kind_ == MIN ? "min" : "max";
+		return name + "(" + left_->print() + (right_ ? ", " + right_->print() : std::string()) + ")";
+	}
+	Expression* transform(Transformer* tr) const { return tr->transformReduction(this); }
+	bool holds() const { return true; } // программы тел
+
+	static double reduce(int kind, Program const& left, Program const* right);
+
+private:
+	int const kind_;
+	Expression const* left_;
+	Expression const* right_;
+	std::shared_ptr<Program const> program_;
+	std::shared_ptr<Program const> rightProgram_;
+};
+
+
+inline bool FunctionRegistry::check(Expression const* expr, std::vector<std::string>& scope, size_t& cost) {
+	++cost;
+	if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr))
+		return check(binop->left(), scope, cost) && check(binop->right(), scope, cost);
+	if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+		if (fcall->definition())
+			cost += fcall->definition()->cost;
+		for (size_t i = 0; i < fcall->arity(); ++i)
+			if (!check(fcall->arg(i), scope, cost))
+				return false;
+		return true;
+	}
+	if (Variable const* var = dynamic_cast<Variable const*>(expr)) // только параметры и имена из let
+		return std::find(scope.begin(), scope.end(), var->name()) != scope.end();
+	if (dynamic_cast<Reduction const*>(expr)) // в ядре функции параметры — столбцы, а свёртка видит только Environment
+		return false;
+	if (Let const* let = dynamic_cast<Let const*>(expr)) {
+		if (!check(let->value(), scope, cost))
+			return false;
+		scope.push_back(let->name());
+		bool ok = check(let->body(), scope, cost);
+		scope.pop_back();
+		return ok;
+	}
+	return true;
+}
+
+
 struct CopySyntaxTree : Transformer {
 public:
 	Expression* transformNumber(Number const* number) {
@@ -128,13 +611,25 @@ public:
 		return exp;
 	}
 	Expression* transformFunctionCall(FunctionCall const* fcall) {
-		Expression* exp = new FunctionCall(fcall->name(), (fcall->arg())->transform(this));
+		std::vector<Expression const*> args;
+		for (size_t i = 0; i < fcall->arity(); ++i)
+			args.push_back(fcall->arg(i)->transform(this));
+		Expression* exp = new FunctionCall(fcall->name(), args);
 		return exp;
 	}
 	Expression* transformVariable(Variable const* var) {
 		Expression* exp = new Variable(var->name());
 		return exp;
 	}
+	Expression* transformLet(Let const* let) {
+		Expression* exp = new Let(let->name(), (let->value())->transform(this), (let->body())->transform(this));
+		return exp;
+	}
+	Expression* transformReduction(Reduction const* reduction) {
+		if (reduction->right())
+			return new Reduction(reduction->kind(), (reduction->arg())->transform(this), (reduction->right())->transform(this));
+		return new Reduction(reduction->kind(), (reduction->arg())->transform(this));
+	}
 };
 
 
@@ -159,11 +654,15 @@ public:
 		return nbinop;
 	}
 	Expression* transformFunctionCall(FunctionCall const* fcall) {
-		Expression* arg = (fcall->arg())->transform(this); // Создаем указатель на аргумент
-		std::string const& nname = fcall->name(); // рекурсивно сворачиваем аргумент
-		FunctionCall* nfcall = new FunctionCall(nname, arg); // Создаем новый объект типа FunctionCall с новым указателем
-		Number* arg_is_number = dynamic_cast<Number*>(arg); // Проверяем на приводимость указателя к типу Number
-		if (arg_is_number) { // если аргумент — число
+		std::vector<Expression const*> args; // рекурсивно сворачиваем аргументы
+		bool args_are_numbers = true;
+		for (size_t i = 0; i < fcall->arity(); ++i) {
+			args.push_back(fcall->arg(i)->transform(this));
+			args_are_numbers = args_are_numbers && dynamic_cast<Number const*>(args.back()); // Проверяем на приводимость указателя к типу Number
+		}
+		std::string const& nname = fcall->name();
+		FunctionCall* nfcall = new FunctionCall(nname, args); // Создаем новый объект типа FunctionCall с новыми указателями
+		if (args_are_numbers) { // если все аргументы — числа
 			Expression* result = new Number(fcall->evaluate());// Вычисляем значение выражения
 			delete nfcall;
 			return result;
@@ -174,10 +673,5112 @@ public:
 		Expression* exp = new Variable(var->name());
 		return exp; // переменные не сворачиваем, поэтому просто возвращаем копию
 	}
+	Expression* transformLet(Let const* let) {
+		Expression* value = (let->value())->transform(this);
+		Expression* body = (let->body())->transform(this);
+		if (dynamic_cast<Number*>(body)) { // тело не зависит от имени — привязка не нужна
+			delete value;
+			return body;
+		}
+		return new Let(let->name(), value, body);
+	}
+	Expression* transformReduction(Reduction const* reduction) { // длина массивов известна только при вычислении, поэтому сворачиваем лишь тела
+		if (reduction->right())
+			return new Reduction(reduction->kind(), (reduction->arg())->transform(this), (reduction->right())->transform(this));
+		return new Reduction(reduction->kind(), (reduction->arg())->transform(this));
+	}
+};
+
+
+struct Instruction { // одна команда постфиксной программы
+	enum {
+		CONST = 'c', // положить на стек константу constants[arg]
+		VAR = 'v', // положить на стек столбец переменной variables[arg]
+		BINOP = 'b', // снять два значения и применить операцию arg (символ из BinaryOperation)
+		SQRT = 's', // корень квадратный из вершины стека
+		ABS = 'a', // модуль вершины стека
+		STORE = 'l', // снять значение в локальную ячейку arg (значение let)
+		LOAD = 'L', // положить на стек локальную ячейку arg
+		CALL = 'f', // снять аргументы общего ядра functions[arg] и положить его результат
+		REDUCE = 'r', // положить на стек значение свёртки reductions[arg]; оно одно на все строки
+		TABLE = 't' // интерполяция по таблице tables[arg] над вершиной стека
+	};
+	int kind;
+	int arg;
+};
+
+
+// Ядра double-double встраиваются в петли по блоку всегда: вызов внутри петли не даёт ей векторизоваться.
+#if defined(__GNUC__)
+#define EXPRESSION_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define EXPRESSION_INLINE __forceinline
+#else
+#define EXPRESSION_INLINE inline
+#endif
+
+struct DoubleDouble { // число двойной-двойной точности: hi + lo, около 106 бит мантиссы
+	double hi;
+	double lo;
+};
+
+// Безошибочные преобразования. Работают только при строгой IEEE-арифметике, поэтому без -ffast-math.
+EXPRESSION_INLINE DoubleDouble twoSum(double a, double b) { // a + b = s + e точно
+	double s = a + b;
+	double bb = s - a;
+	return DoubleDouble{ s, (a - (s - bb)) + (b - bb) };
+}
+EXPRESSION_INLINE DoubleDouble quickTwoSum(double a, double b) { // то же при |a| >= |b|
+	double s = a + b;
+	return DoubleDouble{ s, b - (s - a) };
+}
+EXPRESSION_INLINE DoubleDouble twoProd(double a, double b) { // a * b = p + e точно благодаря FMA
+	double p = a * b;
+	return DoubleDouble{ p, std::fma(a, b, -p) };
+}
+// Бесконечность и NaN в старшей части: поправки из inf - inf дали бы NaN, поэтому тогда берётся значение
+// обычного double. Поправки считаются всегда, а выбор делается без ветвления, чтобы циклы по блоку векторизовались.
+// Условие — маска из битов порядка: сравнение double при строгой IEEE-арифметике мешает компилятору убрать ветвление.
+EXPRESSION_INLINE double ddPick(uint64_t mask, double a, double b) { // a там, где биты mask единичны, иначе b
+	uint64_t x, y;
+	std::memcpy(&x, &a, sizeof x);
+	std::memcpy(&y, &b, sizeof y);
+	x = (x & mask) | (y & ~mask);
+	std::memcpy(&a, &x, sizeof a);
+	return a;
+}
+EXPRESSION_INLINE DoubleDouble ddSelect(DoubleDouble a, double plain) {
+	uint64_t bits;
+	std::memcpy(&bits, &a.hi, sizeof bits);
+	uint64_t const exponent = uint64_t(0x7ff) << 52; // все единицы у inf и NaN
+	uint64_t finite = uint64_t(0) - uint64_t((bits & exponent) != exponent);
+	return DoubleDouble{ ddPick(finite, a.hi, plain), ddPick(finite, a.lo, 0.0) };
+}
+EXPRESSION_INLINE DoubleDouble ddAdd(DoubleDouble a, DoubleDouble b) {
+	DoubleDouble s = twoSum(a.hi, b.hi);
+	DoubleDouble t = twoSum(a.lo, b.lo);
+	DoubleDouble u = quickTwoSum(s.hi, s.lo + t.hi);
+	return ddSelect(quickTwoSum(u.hi, u.lo + t.lo), s.hi);
+}
+EXPRESSION_INLINE DoubleDouble ddNeg(DoubleDouble a) { return DoubleDouble{ -a.hi, -a.lo }; }
+EXPRESSION_INLINE DoubleDouble ddMul(DoubleDouble a, DoubleDouble b) {
+	DoubleDouble p = twoProd(a.hi, b.hi);
+	return ddSelect(quickTwoSum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi)), p.hi);
+}
+EXPRESSION_INLINE DoubleDouble ddDiv(DoubleDouble a, DoubleDouble b) { // три шага уточнения частного
+	double q1 = a.hi / b.hi; // при делении на бесконечность уточнение даёт NaN (0 * inf), и остаётся q1
+	DoubleDouble r = ddAdd(a, ddNeg(ddMul(DoubleDouble{ q1, 0.0 }, b)));
+	double q2 = r.hi / b.hi;
+	r = ddAdd(r, ddNeg(ddMul(DoubleDouble{ q2, 0.0 }, b)));
+	double q3 = r.hi / b.hi;
+	return ddSelect(ddAdd(quickTwoSum(q1, q2), DoubleDouble{ q3, 0.0 }), q1);
+}
+EXPRESSION_INLINE DoubleDouble ddSqrt(DoubleDouble a) { // один шаг Ньютона от корня старшей части
+	double root = std::sqrt(a.hi);
+	double ax = a.hi / root; // для 0, inf и NaN здесь NaN, и остаётся обычный корень
+	DoubleDouble r = ddAdd(a, ddNeg(twoProd(ax, ax)));
+	return ddSelect(twoSum(ax, r.hi * (0.5 / root)), root);
+}
+EXPRESSION_INLINE DoubleDouble ddAbs(DoubleDouble a) { return a.hi < 0.0 ? ddNeg(a) : a; }
+
+
+struct Program { // скомпилированное выражение в обратной польской записи
+public:
+	enum { BLOCK = 256 }; // сколько строк обрабатывает одна команда за проход
+
+	std::vector<Instruction> code;
+	std::vector<double> constants;
+	std::vector<std::string> variables; // порядок столбцов при пакетном вычислении
+	int stackDepth = 0;
+	int locals = 0; // число локальных ячеек для let
+	std::vector<std::shared_ptr<Program const>> functions; // ядра невстроенных функций; их variables — параметры
+	struct Reduced {
+		int kind;
+		std::shared_ptr<Program const> left;
+		std::shared_ptr<Program const> right;
+	};
+	// Свёртки видят массивы и привязки Environment, а не столбцы: значение считается один раз за вызов run.
+	std::vector<Reduced> reductions;
+	std::vector<std::shared_ptr<Table const>> tables;
+
+	int variableIndex(std::string const& name) const {
+		for (size_t i = 0; i < variables.size(); ++i)
+			if (variables[i] == name)
+				return int(i);
+		return -1;
+	}
+
+	// Пакетное вычисление: columns[i] — значения variables[i] для n строк.
+	// Каждая команда проходит целый блок строк, поэтому внутренние циклы векторизуются.
+	void run(std::vector<double const*> const& columns, size_t n, double* out) const {
+		run(columns, n, out, constants.data());
+	}
+	// То же с внешним блоком констант: одна программа обслуживает все деревья одной формы.
+	void run(std::vector<double const*> const& columns, size_t n, double* out, double const* params) const {
+		Scratch scratch;
+		std::vector<double> reduced = reduce();
+		run(columns, n, out, params, reduced.data(), scratch);
+	}
+	struct Scratch { // стек и локальные ячейки run; растут до нужного размера и годятся для нескольких программ
+		std::vector<double> stack;
+		std::vector<double> local;
+		std::vector<Scratch> calls; // буферы ядер functions[i], общие для всех блоков строк
+		std::vector<double const*> args;
+	};
+	// Вызов по частям строк: свёртки посчитаны заранее (reduce), буферы не выделяются заново на каждую часть.
+	void run(std::vector<double const*> const& columns, size_t n, double* out, double const* params,
+		double const* reduced, Scratch& scratch) const {
+		assert(columns.size() == variables.size());
+		if (scratch.stack.size() < size_t(stackDepth) * BLOCK)
+			scratch.stack.resize(size_t(stackDepth) * BLOCK);
+		if (scratch.local.size() < size_t(locals) * BLOCK)
+			scratch.local.resize(size_t(locals) * BLOCK);
+		if (scratch.calls.size() < functions.size())
+			scratch.calls.resize(functions.size());
+		std::vector<double>& stack = scratch.stack;
+		std::vector<double>& local = scratch.local;
+		for (size_t base = 0; base < n; base += BLOCK) {
+			size_t m = std::min<size_t>(BLOCK, n - base);
+			int top = 0;
+			for (Instruction const& ins : code) {
+				double* r = &stack[size_t(top) * BLOCK];
+				switch (ins.kind) {
+				case Instruction::CONST:
+					std::fill(r, r + m, params[ins.arg]);
+					++top;
+					break;
+				case Instruction::VAR:
+					std::copy(columns[ins.arg] + base, columns[ins.arg] + base + m, r);
+					++top;
+					break;
+				case Instruction::BINOP: {
+					double* a = r - 2 * BLOCK;
+					double const* b = r - BLOCK;
+					switch (ins.arg) {
+					case BinaryOperation::PLUS: for (size_t i = 0; i < m; ++i) a[i] += b[i]; break;
+					case BinaryOperation::MINUS: for (size_t i = 0; i < m; ++i) a[i] -= b[i]; break;
+					case BinaryOperation::DIV: for (size_t i = 0; i < m; ++i) a[i] /= b[i]; break;
+					case BinaryOperation::MUL: for (size_t i = 0; i < m; ++i) a[i] *= b[i]; break;
+					}
+					--top;
+					break;
+				}
+				case Instruction::SQRT:
+					for (size_t i = 0; i < m; ++i) (r - BLOCK)[i] = std::sqrt((r - BLOCK)[i]);
+					break;
+				case Instruction::ABS:
+					for (size_t i = 0; i < m; ++i) (r - BLOCK)[i] = std::fabs((r - BLOCK)[i]);
+					break;
+				case Instruction::STORE:
+					std::copy(r - BLOCK, r - BLOCK + m, &local[size_t(ins.arg) * BLOCK]);
+					--top;
+					break;
+				case Instruction::LOAD:
+					std::copy(&local[size_t(ins.arg) * BLOCK], &local[size_t(ins.arg) * BLOCK] + m, r);
+					++top;
+					break;
+				case Instruction::CALL: { // аргументы лежат на вершине стека по порядку; результат занимает место первого
+					Program const& callee = *functions[ins.arg];
+					size_t arity = callee.variables.size();
+					scratch.args.resize(arity);
+					for (size_t j = 0; j < arity; ++j)
+						scratch.args[j] = r - (arity - j) * BLOCK;
+					// m <= BLOCK: ядро пишет результат после чтения всех входов. Свёрток в ядрах функций нет
+					// (их не пропускает FunctionRegistry::check), поэтому и считать заранее нечего.
+					callee.run(scratch.args, m, r - arity * BLOCK, callee.constants.data(), nullptr, scratch.calls[ins.arg]);
+					top += 1 - int(arity);
+					break;
+				}
+				case Instruction::REDUCE:
+					std::fill(r, r + m, reduced[ins.arg]);
+					++top;
+					break;
+				case Instruction::TABLE:
+					tables[ins.arg]->evaluate(r - BLOCK, m, r - BLOCK);
+					break;
+				}
+			}
+			std::copy(stack.begin(), stack.begin() + m, out + base);
+		}
+	}
+
+	// То же вычисление в арифметике double-double: результат строки i равен hi[i] + lo[i].
+	// Стек хранится как два массива (SoA), у каждой операции своя петля по блоку без ветвлений, и петли векторизуются
+	// (петля корня, как и в run, — только с -fno-math-errno: иначе sqrt отрицательного числа ставит errno).
+	// columnsLo — младшие части входов (нужны при вызове ядра функции); без них входы считаются точными double.
+	void runDoubleDouble(std::vector<double const*> const& columns, size_t n, double* hi, double* lo,
+		std::vector<double const*> const* columnsLo = nullptr) const {
+		assert(columns.size() == variables.size());
+		std::vector<double> stackHi(size_t(stackDepth) * BLOCK), stackLo(size_t(stackDepth) * BLOCK);
+		std::vector<double> localHi(size_t(locals) * BLOCK), localLo(size_t(locals) * BLOCK);
+		std::vector<double> reduced = reduce(); // свёртки считаются в double
+		for (size_t base = 0; base < n; base += BLOCK) {
+			size_t m = std::min<size_t>(BLOCK, n - base);
+			int top = 0;
+			for (Instruction const& ins : code) {
+				double* rh = &stackHi[size_t(top) * BLOCK];
+				double* rl = &stackLo[size_t(top) * BLOCK];
+				switch (ins.kind) {
+				case Instruction::CONST:
+					std::fill(rh, rh + m, constants[ins.arg]);
+					std::fill(rl, rl + m, 0.0);
+					++top;
+					break;
+				case Instruction::VAR:
+					std::copy(columns[ins.arg] + base, columns[ins.arg] + base + m, rh);
+					if (columnsLo)
+						std::copy((*columnsLo)[ins.arg] + base, (*columnsLo)[ins.arg] + base + m, rl);
+					else
+						std::fill(rl, rl + m, 0.0);
+					++top;
+					break;
+				case Instruction::BINOP: // своя петля на каждую операцию: в теле петли нет ветвлений
+					switch (ins.arg) {
+					case BinaryOperation::PLUS:
+						ddLoop(rh - 2 * BLOCK, rl - 2 * BLOCK, rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a, DoubleDouble b) { return ddAdd(a, b); });
+						break;
+					case BinaryOperation::MINUS:
+						ddLoop(rh - 2 * BLOCK, rl - 2 * BLOCK, rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a, DoubleDouble b) { return ddAdd(a, ddNeg(b)); });
+						break;
+					case BinaryOperation::DIV:
+						ddLoop(rh - 2 * BLOCK, rl - 2 * BLOCK, rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a, DoubleDouble b) { return ddDiv(a, b); });
+						break;
+					case BinaryOperation::MUL:
+						ddLoop(rh - 2 * BLOCK, rl - 2 * BLOCK, rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a, DoubleDouble b) { return ddMul(a, b); });
+						break;
+					}
+					--top;
+					break;
+				case Instruction::SQRT:
+					ddLoop(rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a) { return ddSqrt(a); });
+					break;
+				case Instruction::ABS:
+					ddLoop(rh - BLOCK, rl - BLOCK, m, [](DoubleDouble a) { return ddAbs(a); });
+					break;
+				case Instruction::STORE:
+					std::copy(rh - BLOCK, rh - BLOCK + m, &localHi[size_t(ins.arg) * BLOCK]);
+					std::copy(rl - BLOCK, rl - BLOCK + m, &localLo[size_t(ins.arg) * BLOCK]);
+					--top;
+					break;
+				case Instruction::LOAD:
+					std::copy(&localHi[size_t(ins.arg) * BLOCK], &localHi[size_t(ins.arg) * BLOCK] + m, rh);
+					std::copy(&localLo[size_t(ins.arg) * BLOCK], &localLo[size_t(ins.arg) * BLOCK] + m, rl);
+					++top;
+					break;
+				case Instruction::CALL: {
+					Program const& callee = *functions[ins.arg];
+					size_t arity = callee.variables.size();
+					std::vector<double const*> argsHi(arity), argsLo(arity);
+					for (size_t j = 0; j < arity; ++j) {
+						argsHi[j] = rh - (arity - j) * BLOCK;
+						argsLo[j] = rl - (arity - j) * BLOCK;
+					}
+					callee.runDoubleDouble(argsHi, m, rh - arity * BLOCK, rl - arity * BLOCK, &argsLo);
+					top += 1 - int(arity);
+					break;
+				}
+				case Instruction::REDUCE:
+					std::fill(rh, rh + m, reduced[ins.arg]);
+					std::fill(rl, rl + m, 0.0);
+					++top;
+					break;
+				case Instruction::TABLE: // таблица задана в double: аргумент округляется, результат точен до double
+					for (size_t i = 0; i < m; ++i)
+						(rh - BLOCK)[i] += (rl - BLOCK)[i];
+					tables[ins.arg]->evaluate(rh - BLOCK, m, rh - BLOCK);
+					std::fill(rl - BLOCK, rl - BLOCK + m, 0.0);
+					break;
+				}
+			}
+			std::copy(stackHi.begin(), stackHi.begin() + m, hi + base);
+			std::copy(stackLo.begin(), stackLo.begin() + m, lo + base);
+		}
+	}
+
+private:
+	// a = op(a, b) и a = op(a) по блоку; op — лямбда, своя у каждой операции, поэтому встраивается в петлю.
+	template <class Op>
+	static void ddLoop(double* __restrict ah, double* __restrict al, double const* __restrict bh, double const* __restrict bl, size_t m, Op op) {
+		for (size_t i = 0; i < m; ++i) {
+			DoubleDouble c = op(DoubleDouble{ ah[i], al[i] }, DoubleDouble{ bh[i], bl[i] });
+			ah[i] = c.hi;
+			al[i] = c.lo;
+		}
+	}
+	template <class Op>
+	static void ddLoop(double* __restrict ah, double* __restrict al, size_t m, Op op) {
+		for (size_t i = 0; i < m; ++i) {
+			DoubleDouble c = op(DoubleDouble{ ah[i], al[i] });
+			ah[i] = c.hi;
+			al[i] = c.lo;
+		}
+	}
+
+public:
+	std::vector<double> reduce() const { // значения всех свёрток программы
+		std::vector<double> values;
+		for (Reduced const& r : reductions)
+			values.push_back(Reduction::reduce(r.kind, *r.left, r.right.get()));
+		return values;
+	}
+};
+
+
+struct CompileLimits { // бюджет формулы из недоверенного источника
+	size_t nodes = std::numeric_limits<size_t>::max(); // с учётом тел вызываемых функций
+	size_t depth = std::numeric_limits<size_t>::max();
+	double operations = std::numeric_limits<double>::infinity(); // оценка операций на строку
+	size_t elements = 1024; // предполагаемая длина массивов в свёртках
+};
+
+
+struct Cost {
+	size_t nodes = 0;
+	size_t depth = 0;
+	double operations = 0.0;
+
+	bool within(CompileLimits const& limits) const {
+		return nodes <= limits.nodes && depth <= limits.depth && operations <= limits.operations;
+	}
+	// Обход без рекурсии: стек вызовов не зависит от формы дерева. Как только превышен лимит узлов или глубины,
+	// обход прекращается, поэтому отказ огромной формуле стоит не больше самих лимитов.
+	static Cost estimate(Expression const* expr, CompileLimits const& limits = CompileLimits()) {
+		struct Item {
+			Expression const* expr;
+			size_t depth;
+			double weight; // сколько раз узел выполняется на строку: внутри свёртки — по разу на элемент
+		};
+		Cost cost;
+		std::vector<Item> stack(1, Item{ expr, 1, 1.0 });
+		while (!stack.empty() && cost.within(limits)) {
+			Item item = stack.back();
+			stack.pop_back();
+			++cost.nodes;
+			cost.depth = std::max(cost.depth, item.depth);
+			double operations = 1.0;
+			Expression const* node = item.expr;
+			if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(node)) {
+				operations = binop->operation() == BinaryOperation::DIV ? 4.0 : 1.0;
+				stack.push_back(Item{ binop->left(), item.depth + 1, item.weight });
+				stack.push_back(Item{ binop->right(), item.depth + 1, item.weight });
+			}
+			else if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(node)) {
+				FunctionRegistry::Definition const* definition = fcall->definition();
+				if (!definition)
+					operations = fcall->name() == "sqrt" ? 4.0 : 1.0;
+				else if (definition->table)
+					operations = 8.0; // поиск отрезка и многочлен
+				else {
+					cost.nodes += definition->cost;
+					operations = double(definition->cost);
+				}
+				for (size_t i = 0; i < fcall->arity(); ++i)
+					stack.push_back(Item{ fcall->arg(i), item.depth + 1, item.weight });
+			}
+			else if (Let const* let = dynamic_cast<Let const*>(node)) {
+				stack.push_back(Item{ let->value(), item.depth + 1, item.weight });
+				stack.push_back(Item{ let->body(), item.depth + 1, item.weight });
+			}
+			else if (Reduction const* reduction = dynamic_cast<Reduction const*>(node)) {
+				double weight = item.weight * double(limits.elements);
+				stack.push_back(Item{ reduction->arg(), item.depth + 1, weight });
+				if (reduction->right())
+					stack.push_back(Item{ reduction->right(), item.depth + 1, weight });
+			}
+			cost.operations += operations * item.weight;
+		}
+		return cost;
+	}
+};
+
+
+struct Compiler { // перевод дерева в постфиксную программу
+public:
+	enum { INLINE_LIMIT = 32 }; // тела функций не дороже этого числа узлов встраиваются в место вызова
+
+	// inlineLimit = SIZE_MAX встраивает все вызовы (так нужно, например, для FixedPointProgram),
+	// 0 — ни одного: каждая функция вызывается как общее ядро.
+	Compiler(size_t inlineLimit = INLINE_LIMIT) : inlineLimit_(inlineLimit) {}
+
+	// Свёртка не может читать столбец программы или имя из let (см. build): такая формула — ошибка вызывающего.
+	Program compile(Expression const* expr) {
+		bool separate = build(expr);
+		assert(separate);
+		(void)separate;
+		return program_;
+	}
+	// Тело свёртки: его столбцы — массивы и привязки Environment, а не строки пакета, так что проверки столбцов нет.
+	Program compileBody(Expression const* expr) {
+		build(expr);
+		return program_;
+	}
+	// То же с бюджетом: формула, оценка которой превышает limits, не компилируется, и возвращается false.
+	bool compile(Expression const* expr, CompileLimits const& limits, Program& program, Cost* cost = nullptr) {
+		Cost estimate = Cost::estimate(expr, limits);
+		if (cost)
+			*cost = estimate;
+		if (!estimate.within(limits) || !build(expr)) // недоверенная формула со свёрткой по столбцу отклоняется
+			return false;
+		program = program_;
+		return true;
+	}
+	// Общее ядро функции: столбцы — её параметры. Компилируется один раз и хранится в реестре.
+	std::shared_ptr<Program const> kernel(FunctionRegistry::Definition const* definition) const {
+		FunctionRegistry& registry = FunctionRegistry::instance();
+		std::shared_ptr<Program const> kernel = registry.kernel(definition);
+		if (kernel)
+			return kernel;
+		Compiler compiler(inlineLimit_);
+		compiler.program_.variables = definition->params; // тело ссылается только на параметры, порядок столбцов фиксирован
+		compiler.depth_ = 0;
+		if (definition->table) {
+			compiler.push(Instruction::VAR, 0);
+			compiler.program_.tables.push_back(definition->table);
+			compiler.push(Instruction::TABLE, 0);
+		}
+		else
+			compiler.emit(definition->body);
+		return registry.setKernel(definition, std::make_shared<Program const>(compiler.program_));
+	}
+	// То, что compile вынес бы из дерева, без построения программы: константы, столбцы, свёртки, таблицы, ядра
+	// функций в том же порядке и сами команды. Нужно кэшу, у которого ядро формы уже есть.
+	struct Operands {
+		std::vector<double> constants;
+		std::vector<std::string> variables;
+		std::vector<Program::Reduced> reductions;
+		std::vector<std::shared_ptr<Table const>> tables;
+		std::vector<std::shared_ptr<Program const>> functions;
+		std::vector<Instruction> code;
+		int locals = 0;
+	};
+	Operands operands(Expression const* expr) {
+		Operands result;
+		scope_.clear();
+		collect(expr, result);
+		return result;
+	}
+
+private:
+	// Компилирует expr в program_. Значение свёртки считается один раз на вызов run и одинаково для всех строк,
+	// поэтому свёртка (в том числе вложенная), читающая имя, которое у программы является столбцом или ячейкой
+	// let, дала бы в пакете не то, что evaluate; тогда возвращается false.
+	bool build(Expression const* expr) {
+		program_ = Program();
+		depth_ = 0;
+		scope_.clear();
+		hidden_ = false;
+		emit(expr);
+		if (hidden_)
+			return false;
+		for (std::string const& name : program_.variables)
+			for (Program::Reduced const& reduced : program_.reductions)
+				if (reads(*reduced.left, name) || (reduced.right && reads(*reduced.right, name)))
+					return false;
+		return true;
+	}
+	static bool reads(Program const& program, std::string const& name) {
+		if (program.variableIndex(name) >= 0)
+			return true;
+		for (Program::Reduced const& reduced : program.reductions)
+			if (reads(*reduced.left, name) || (reduced.right && reads(*reduced.right, name)))
+				return true;
+		return false;
+	}
+	void collect(Expression const* expr, Operands& result) { // обход и номера команд в точности как у emit
+		if (Number const* number = dynamic_cast<Number const*>(expr)) {
+			result.constants.push_back(number->value());
+			result.code.push_back(Instruction{ Instruction::CONST, int(result.constants.size()) - 1 });
+		}
+		else if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			collect(binop->left(), result);
+			collect(binop->right(), result);
+			result.code.push_back(Instruction{ Instruction::BINOP, binop->operation() });
+		}
+		else if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+			FunctionRegistry::Definition const* definition = fcall->definition();
+			if (!definition) {
+				collect(fcall->arg(), result);
+				result.code.push_back(Instruction{ fcall->name() == "sqrt" ? Instruction::SQRT : Instruction::ABS, 0 });
+			}
+			else if (definition->table) {
+				collect(fcall->arg(), result);
+				result.tables.push_back(definition->table);
+				result.code.push_back(Instruction{ Instruction::TABLE, int(result.tables.size()) - 1 });
+			}
+			else if (definition->cost <= inlineLimit_) {
+				std::vector<std::pair<std::string, int>> frame;
+				for (size_t i = 0; i < fcall->arity(); ++i) {
+					collect(fcall->arg(i), result);
+					int slot = result.locals++;
+					result.code.push_back(Instruction{ Instruction::STORE, slot });
+					frame.emplace_back(definition->params[i], slot);
+				}
+				std::swap(scope_, frame);
+				collect(definition->body, result);
+				std::swap(scope_, frame);
+			}
+			else {
+				for (size_t i = 0; i < fcall->arity(); ++i)
+					collect(fcall->arg(i), result);
+				result.functions.push_back(kernel(definition)); // ядро кэшируется реестром
+				result.code.push_back(Instruction{ Instruction::CALL, int(result.functions.size()) - 1 });
+			}
+		}
+		else if (Variable const* var = dynamic_cast<Variable const*>(expr)) {
+			for (size_t i = scope_.size(); i-- > 0; )
+				if (scope_[i].first == var->name()) {
+					result.code.push_back(Instruction{ Instruction::LOAD, scope_[i].second });
+					return;
+				}
+			auto found = std::find(result.variables.begin(), result.variables.end(), var->name());
+			if (found == result.variables.end())
+				found = result.variables.insert(result.variables.end(), var->name());
+			result.code.push_back(Instruction{ Instruction::VAR, int(found - result.variables.begin()) });
+		}
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) {
+			collect(let->value(), result);
+			int slot = result.locals++;
+			result.code.push_back(Instruction{ Instruction::STORE, slot });
+			scope_.emplace_back(let->name(), slot);
+			collect(let->body(), result);
+			scope_.pop_back();
+		}
+		else if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) {
+			result.reductions.push_back(Program::Reduced{ reduction->kind(), reduction->program(), reduction->rightProgram() });
+			result.code.push_back(Instruction{ Instruction::REDUCE, int(result.reductions.size()) - 1 });
+		}
+	}
+
+	void push(int kind, int arg) {
+		program_.code.push_back(Instruction{ kind, arg });
+		if (kind == Instruction::CONST || kind == Instruction::VAR || kind == Instruction::LOAD || kind == Instruction::REDUCE)
+			program_.stackDepth = std::max(program_.stackDepth, ++depth_);
+		else if (kind == Instruction::BINOP || kind == Instruction::STORE)
+			--depth_;
+		else if (kind == Instruction::CALL) {
+			depth_ += 1 - int(program_.functions[arg]->variables.size());
+			program_.stackDepth = std::max(program_.stackDepth, depth_);
+		}
+	}
+	void emit(Expression const* expr) {
+		if (Number const* number = dynamic_cast<Number const*>(expr)) {
+			program_.constants.push_back(number->value());
+			push(Instruction::CONST, int(program_.constants.size()) - 1);
+		}
+		else if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			emit(binop->left());
+			emit(binop->right());
+			push(Instruction::BINOP, binop->operation());
+		}
+		else if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+			FunctionRegistry::Definition const* definition = fcall->definition();
+			if (!definition) {
+				emit(fcall->arg());
+				push(fcall->name() == "sqrt" ? Instruction::SQRT : Instruction::ABS, 0);
+			}
+			else if (definition->table) {
+				emit(fcall->arg());
+				program_.tables.push_back(definition->table);
+				push(Instruction::TABLE, int(program_.tables.size()) - 1);
+			}
+			else if (definition->cost <= inlineLimit_) { // аргументы в ячейки, тело видит только параметры
+				std::vector<std::pair<std::string, int>> frame;
+				for (size_t i = 0; i < fcall->arity(); ++i) {
+					emit(fcall->arg(i));
+					int slot = program_.locals++;
+					push(Instruction::STORE, slot);
+					frame.emplace_back(definition->params[i], slot);
+				}
+				std::swap(scope_, frame);
+				emit(definition->body);
+				std::swap(scope_, frame);
+			}
+			else {
+				for (size_t i = 0; i < fcall->arity(); ++i)
+					emit(fcall->arg(i));
+				program_.functions.push_back(kernel(definition));
+				push(Instruction::CALL, int(program_.functions.size()) - 1);
+			}
+		}
+		else if (Variable const* var = dynamic_cast<Variable const*>(expr)) {
+			for (size_t i = scope_.size(); i-- > 0; )
+				if (scope_[i].first == var->name()) { // имя связано объемлющим let
+					push(Instruction::LOAD, scope_[i].second);
+					return;
+				}
+			int index = program_.variableIndex(var->name());
+			if (index < 0) {
+				program_.variables.push_back(var->name());
+				index = int(program_.variables.size()) - 1;
+			}
+			push(Instruction::VAR, index);
+		}
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) { // значение считается один раз и хранится в ячейке
+			emit(let->value());
+			int slot = program_.locals++;
+			push(Instruction::STORE, slot);
+			scope_.emplace_back(let->name(), slot);
+			emit(let->body());
+			scope_.pop_back();
+		}
+		else if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) { // тело уже скомпилировано узлом
+			for (std::pair<std::string, int> const& bound : scope_) // ячейки let свёртке не видны
+				if (reads(*reduction->program(), bound.first) || (reduction->rightProgram() && reads(*reduction->rightProgram(), bound.first)))
+					hidden_ = true;
+			program_.reductions.push_back(Program::Reduced{ reduction->kind(), reduction->program(), reduction->rightProgram() });
+			push(Instruction::REDUCE, int(program_.reductions.size()) - 1);
+		}
+	}
+
+	size_t const inlineLimit_;
+	Program program_;
+	int depth_;
+	std::vector<std::pair<std::string, int>> scope_; // имена из let и их ячейки, от внешних к внутренним
+	bool hidden_; // свёртка читает имя из let (см. build)
+};
+
+
+inline Reduction::Reduction(int kind, Expression const* arg)
+	: kind_(kind), left_(arg), right_(nullptr), program_(std::make_shared<Program const>(Compiler().compileBody(arg))) {
+	assert(left_);
+	assert(kind_ == SUM || kind_ == NORM || kind_ == MIN || kind_ == MAX);
+	track();
+}
+
+
+inline Reduction::Reduction(int kind, Expression const* left, Expression const* right)
+	: kind_(kind), left_(left), right_(right), program_(std::make_shared<Program const>(Compiler().compileBody(left))),
+	rightProgram_(std::make_shared<Program const>(Compiler().compileBody(right))) {
+	assert(left_ && right_);
+	assert(kind_ == DOT);
+	track();
+}
+
+
+inline double Reduction::reduce(int kind, Program const& left, Program const* right) {
+	enum { ACCUMULATORS = 4 }; // независимые цепочки сложений не ждут друг друга и векторизуются
+	size_t n = 0;
+	bool sized = false;
+	std::vector<double const*> arrays[2]; // для каждой переменной тела: начало массива или пусто для скаляра
+	std::vector<double> broadcast[2]; // скаляры, размноженные на блок
+	Program const* programs[2] = { &left, right };
+	for (int p = 0; p < 2 && programs[p]; ++p)
+		for (std::string const& name : programs[p]->variables) {
+			Environment::Array const* array = Environment::lookupArray(name);
+			double value = 0.0;
+			if (!array)
+				Environment::lookup(name, value);
+			else {
+				assert(!sized || array->size == n); // массивы одной свёртки должны быть одной длины
+				n = array->size;
+				sized = true;
+			}
+			arrays[p].push_back(array ? array->data : nullptr);
+			broadcast[p].resize(broadcast[p].size() + Program::BLOCK, value);
+		}
+	double acc[ACCUMULATORS];
+	std::fill(acc, acc + ACCUMULATORS, kind == MIN ? std::numeric_limits<double>::infinity()
+		: kind == MAX ? -std::numeric_limits<double>::infinity() : 0.0);
+	std::vector<double> a(Program::BLOCK), b(right ? Program::BLOCK : 0);
+	std::vector<double const*> columns[2] = { std::vector<double const*>(arrays[0].size()), std::vector<double const*>(arrays[1].size()) };
+	std::vector<double> reduced[2] = { left.reduce(), right ? right->reduce() : std::vector<double>() }; // вложенные свёртки — один раз
+	Program::Scratch scratch; // один на оба тела и все блоки
+	for (size_t base = 0; base < n; base += Program::BLOCK) {
+		size_t m = std::min<size_t>(Program::BLOCK, n - base);
+		for (int p = 0; p < 2 && programs[p]; ++p)
+			for (size_t j = 0; j < arrays[p].size(); ++j)
+				columns[p][j] = arrays[p][j] ? arrays[p][j] + base : &broadcast[p][j * Program::BLOCK];
+		left.run(columns[0], m, a.data(), left.constants.data(), reduced[0].data(), scratch);
+		if (right)
+			right->run(columns[1], m, b.data(), right->constants.data(), reduced[1].data(), scratch);
+		size_t i = 0, whole = m - m % ACCUMULATORS;
+		switch (kind) {
+		case SUM:
+			for (; i < whole; i += ACCUMULATORS)
+				for (int k = 0; k < ACCUMULATORS; ++k) acc[k] += a[i + k];
+			for (; i < m; ++i) acc[0] += a[i];
+			break;
+		case DOT:
+			for (; i < whole; i += ACCUMULATORS)
+				for (int k = 0; k < ACCUMULATORS; ++k) acc[k] += a[i + k] * b[i + k];
+			for (; i < m; ++i) acc[0] += a[i] * b[i];
+			break;
+		case NORM:
+			for (; i < whole; i += ACCUMULATORS)
+				for (int k = 0; k < ACCUMULATORS; ++k) acc[k] += a[i + k] * a[i + k];
+			for (; i < m; ++i) acc[0] += a[i] * a[i];
+			break;
+		case MIN:
+			for (; i < whole; i += ACCUMULATORS)
+				for (int k = 0; k < ACCUMULATORS; ++k) acc[k] = std::min(acc[k], a[i + k]);
+			for (; i < m; ++i) acc[0] = std::min(acc[0], a[i]);
+			break;
+		default:
+			for (; i < whole; i += ACCUMULATORS)
+				for (int k = 0; k < ACCUMULATORS; ++k) acc[k] = std::max(acc[k], a[i + k]);
+			for (; i < m; ++i) acc[0] = std::max(acc[0], a[i]);
+			break;
+		}
+	}
+	if (kind == MIN)
+		return std::min(std::min(acc[0], acc[1]), std::min(acc[2], acc[3]));
+	if (kind == MAX)
+		return std::max(std::max(acc[0], acc[1]), std::max(acc[2], acc[3]));
+	double total = (acc[0] + acc[1]) + (acc[2] + acc[3]); // порядок слияния фиксирован, результат воспроизводим
+	return kind == NORM ? std::sqrt(total) : total;
+}
+
+
+struct Interval { // диапазон значений узла для анализа масштабов
+	double lo;
+	double hi;
+};
+
+
+// Целочисленное вычисление в фиксированной точке: на пути вычисления нет ни одной операции с плавающей точкой,
+// поэтому результат побитово совпадает на любой машине. Формат Qm.n задаётся числом дробных битов n;
+// входы передаются в этом формате, а масштаб каждого узла выбирается анализом диапазонов.
+struct FixedPointProgram {
+public:
+	enum {
+		SATURATE, // переполнение прижимается к границе диапазона
+		CHECKED // переполнение прерывает вычисление с ошибкой
+	};
+
+	struct Step { // команда программы вместе с масштабами операндов и результата
+		int kind;
+		int arg;
+		int frac; // число дробных битов результата
+		int fracA; // дробные биты левого (или единственного) операнда
+		int fracB; // дробные биты правого операнда
+		int64_t value; // константа, уже переведённая в масштаб frac
+	};
+
+	// ranges[i] — допустимый диапазон переменной program.variables[i].
+	// Вызовы общих ядер не поддерживаются: программу нужно компилировать с Compiler(SIZE_MAX). Свёртки и таблицы тоже.
+	// Если диапазон какого-то узла не ограничен (делитель может быть нулём) или не помещается в int64,
+	// масштаба для него нет: программа невалидна, и evaluate/run в любом режиме возвращают false.
+	FixedPointProgram(Program const& program, std::vector<Interval> const& ranges, int fracBits, int mode)
+		: variables_(program.variables), fracBits_(fracBits), mode_(mode), locals_(program.locals), valid_(true) {
+		assert(ranges.size() == program.variables.size());
+		assert(fracBits >= 0 && fracBits <= 62);
+		assert(program.functions.empty() && program.reductions.empty() && program.tables.empty());
+		std::vector<Interval> intervals; // стек диапазонов
+		std::vector<int> fracs; // стек масштабов
+		std::vector<Interval> localRanges(program.locals); // диапазоны и масштабы значений let
+		std::vector<int> localFracs(program.locals);
+		for (Instruction const& ins : program.code) {
+			Step step = { ins.kind, ins.arg, 0, 0, 0, 0 };
+			Interval r;
+			switch (ins.kind) {
+			case Instruction::CONST:
+				r = Interval{ program.constants[ins.arg], program.constants[ins.arg] };
+				break;
+			case Instruction::VAR:
+				r = ranges[ins.arg];
+				break;
+			case Instruction::LOAD:
+				r = localRanges[ins.arg];
+				break;
+			case Instruction::STORE: // ячейка хранит значение в масштабе, выбранном для него
+				localRanges[ins.arg] = intervals.back(); intervals.pop_back();
+				localFracs[ins.arg] = step.frac = step.fracA = fracs.back(); fracs.pop_back();
+				steps_.push_back(step);
+				continue;
+			case Instruction::BINOP: {
+				Interval b = intervals.back(); intervals.pop_back();
+				Interval a = intervals.back(); intervals.pop_back();
+				step.fracB = fracs.back(); fracs.pop_back();
+				step.fracA = fracs.back(); fracs.pop_back();
+				r = combine(a, ins.arg, b);
+				break;
+			}
+			default: {
+				Interval a = intervals.back(); intervals.pop_back();
+				step.fracA = fracs.back(); fracs.pop_back();
+				if (ins.kind == Instruction::SQRT)
+					r = Interval{ std::sqrt(std::max(a.lo, 0.0)), std::sqrt(std::max(a.hi, 0.0)) };
+				else if (a.lo >= 0.0)
+					r = a;
+				else if (a.hi <= 0.0)
+					r = Interval{ -a.hi, -a.lo };
+				else
+					r = Interval{ 0.0, std::max(-a.lo, a.hi) };
+				break;
+			}
+			}
+			if (!representable(r))
+				valid_ = false;
+			step.frac = ins.kind == Instruction::VAR ? fracBits : ins.kind == Instruction::LOAD ? localFracs[ins.arg] : scaleFor(r);
+			if (ins.kind == Instruction::CONST) // перевод константы — единственное место с double, и он во время компиляции
+				step.value = saturate(std::ldexp(program.constants[ins.arg], step.frac));
+			intervals.push_back(r);
+			fracs.push_back(step.frac);
+			steps_.push_back(step);
+		}
+		resultFrac_ = fracs.back();
+	}
+
+	std::vector<std::string> const& variables() const { return variables_; }
+	bool valid() const { return valid_; } // у каждого узла есть конечный диапазон и масштаб
+	int resultFrac() const { return resultFrac_; } // дробные биты результата
+	std::vector<Step> const& steps() const { return steps_; }
+
+	// Вычисление одной строки. inputs[i] — значение variables[i] в формате Q с fracBits дробными битами.
+	// Возвращает false, если программа невалидна или в режиме CHECKED произошло переполнение или sqrt от отрицательного.
+	bool evaluate(int64_t const* inputs, int64_t& result) const {
+		if (!valid_)
+			return false;
+		std::vector<int64_t> stack, local(static_cast<size_t>(locals_));
+		stack.reserve(steps_.size());
+		bool ok = true;
+		for (Step const& step : steps_) {
+			switch (step.kind) {
+			case Instruction::CONST:
+				stack.push_back(step.value);
+				break;
+			case Instruction::VAR:
+				stack.push_back(inputs[step.arg]);
+				break;
+			case Instruction::BINOP: {
+				int64_t b = stack.back(); stack.pop_back();
+				int64_t& a = stack.back();
+				switch (step.arg) {
+				case BinaryOperation::PLUS:
+				case BinaryOperation::MINUS: {
+					int64_t x = rescale(a, step.fracA, step.frac, ok);
+					int64_t y = rescale(b, step.fracB, step.frac, ok);
+					a = step.arg == BinaryOperation::PLUS ? add(x, y, ok) : add(x, negate(y, ok), ok);
+					break;
+				}
+				case BinaryOperation::MUL: a = multiply(a, b, step.fracA + step.fracB - step.frac, ok); break;
+				case BinaryOperation::DIV: a = divide(a, b, step.frac + step.fracB - step.fracA, ok); break;
+				}
+				break;
+			}
+			case Instruction::ABS:
+				stack.back() = rescale(stack.back() < 0 ? negate(stack.back(), ok) : stack.back(), step.fracA, step.frac, ok);
+				break;
+			case Instruction::SQRT:
+				stack.back() = squareRoot(stack.back(), 2 * step.frac - step.fracA, ok);
+				break;
+			case Instruction::STORE:
+				local[step.arg] = stack.back();
+				stack.pop_back();
+				break;
+			case Instruction::LOAD:
+				stack.push_back(local[step.arg]);
+				break;
+			}
+			if (!ok && mode_ == CHECKED)
+				return false;
+		}
+		result = stack.back();
+		return true;
+	}
+
+	// Пакетный вариант: columns[i] — столбец variables[i]; возвращает false при первой ошибке в режиме CHECKED.
+	bool run(std::vector<int64_t const*> const& columns, size_t n, int64_t* out) const {
+		assert(columns.size() == variables_.size());
+		if (!valid_)
+			return false;
+		std::vector<int64_t> row(columns.size());
+		for (size_t i = 0; i < n; ++i) {
+			for (size_t j = 0; j < columns.size(); ++j)
+				row[j] = columns[j][i];
+			if (!evaluate(row.data(), out[i]))
+				return false;
+		}
+		return true;
+	}
+
+private:
+	static Interval combine(Interval a, int op, Interval b) {
+		double const inf = std::numeric_limits<double>::infinity();
+		switch (op) {
+		case BinaryOperation::PLUS: return Interval{ a.lo + b.lo, a.hi + b.hi };
+		case BinaryOperation::MINUS: return Interval{ a.lo - b.hi, a.hi - b.lo };
+		case BinaryOperation::DIV:
+			if (b.lo <= 0.0 && b.hi >= 0.0)
+				return Interval{ -inf, inf }; // делитель может быть нулём: масштаба нет, программа невалидна
+			b = Interval{ 1.0 / b.hi, 1.0 / b.lo };
+		}
+		double p[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+		return Interval{ *std::min_element(p, p + 4), *std::max_element(p, p + 4) };
+	}
+	static bool representable(Interval r) { // конечный диапазон, целая часть которого помещается в int64
+		return std::max(std::fabs(r.lo), std::fabs(r.hi)) < 4e18;
+	}
+	int scaleFor(Interval r) const { // старший бит целой части определяет, сколько дробных битов остаётся
+		double m = std::max(std::fabs(r.lo), std::fabs(r.hi));
+		if (!(m < 4e18))
+			return 0; // программа уже помечена невалидной
+		int intBits = m < 1.0 ? 0 : std::ilogb(m) + 1;
+		return std::max(0, std::min(fracBits_, 62 - intBits));
+	}
+	int64_t saturate(double v) const {
+		if (!(v < 9.2e18))
+			return v != v ? 0 : INT64_MAX;
+		if (v < -9.2e18)
+			return INT64_MIN;
+		return int64_t(std::llround(v));
+	}
+	int64_t overflow(bool negative, bool& ok) const {
+		ok = false;
+		return negative ? INT64_MIN : INT64_MAX;
+	}
+	int64_t add(int64_t a, int64_t b, bool& ok) const {
+		int64_t r = int64_t(uint64_t(a) + uint64_t(b));
+		if ((a < 0) == (b < 0) && (r < 0) != (a < 0))
+			return overflow(a < 0, ok);
+		return r;
+	}
+	int64_t negate(int64_t a, bool& ok) const {
+		return a == INT64_MIN ? overflow(false, ok) : -a;
+	}
+	int64_t rescale(int64_t v, int from, int to, bool& ok) const {
+		if (to <= from)
+			return v >> (from - to); // арифметический сдвиг, округление вниз
+		int shift = to - from;
+		if (v > (INT64_MAX >> shift) || v < (INT64_MIN >> shift))
+			return overflow(v < 0, ok);
+		return int64_t(uint64_t(v) << shift);
+	}
+	int64_t fromMagnitude(uint64_t m, bool negative, bool& ok) const { // знак + модуль -> int64
+		if (m > uint64_t(INT64_MAX) + (negative ? 1 : 0))
+			return overflow(negative, ok);
+		return negative ? int64_t(0 - m) : int64_t(m);
+	}
+	static uint64_t magnitude(int64_t v) { return v < 0 ? 0 - uint64_t(v) : uint64_t(v); }
+	// Произведение с масштабом fa + fb, сдвинутое на shift битов вправо; 128-битный результат собирается из 32-битных половин.
+	int64_t multiply(int64_t a, int64_t b, int shift, bool& ok) const {
+		uint64_t x = magnitude(a), y = magnitude(b);
+		uint64_t x0 = x & 0xffffffffu, x1 = x >> 32, y0 = y & 0xffffffffu, y1 = y >> 32;
+		uint64_t p00 = x0 * y0, p01 = x0 * y1, p10 = x1 * y0, p11 = x1 * y1;
+		uint64_t mid = (p00 >> 32) + (p01 & 0xffffffffu) + (p10 & 0xffffffffu);
+		uint64_t lo = (mid << 32) | (p00 & 0xffffffffu);
+		uint64_t hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+		bool negative = (a < 0) != (b < 0);
+		if (shift < 0) { // результату нужно больше дробных битов, чем у произведения
+			if (hi != 0)
+				return overflow(negative, ok);
+			return rescale(fromMagnitude(lo, negative, ok), 0, -shift, ok);
+		}
+		if (shift >= 64) {
+			lo = hi >> (shift - 64);
+			hi = 0;
+		}
+		else if (shift > 0) {
+			lo = (lo >> shift) | (hi << (64 - shift));
+			hi >>= shift;
+		}
+		if (hi != 0)
+			return overflow(negative, ok);
+		return fromMagnitude(lo, negative, ok);
+	}
+	// Частное a / b, умноженное на 2^shift: целая часть делением, дробные биты — делением столбиком.
+	int64_t divide(int64_t a, int64_t b, int shift, bool& ok) const {
+		bool negative = (a < 0) != (b < 0);
+		if (b == 0)
+			return overflow(a < 0, ok);
+		uint64_t x = magnitude(a), y = magnitude(b);
+		if (shift < 0)
+			return fromMagnitude(shift <= -64 ? 0 : (x / y) >> -shift, negative, ok);
+		uint64_t q = x / y, r = x % y;
+		for (int i = 0; i < shift; ++i) {
+			if (q >> 63)
+				return overflow(negative, ok);
+			r <<= 1; // r < y <= 2^63, переполнения нет
+			q <<= 1;
+			if (r >= y) {
+				r -= y;
+				q |= 1;
+			}
+		}
+		return fromMagnitude(q, negative, ok);
+	}
+	// Корень из v * 2^shift методом Ньютона в целых числах.
+	int64_t squareRoot(int64_t v, int shift, bool& ok) const {
+		if (v < 0) {
+			ok = false; // в режиме SATURATE корень из отрицательного считается нулём
+			return 0;
+		}
+		uint64_t m = uint64_t(v);
+		int headroom = 0;
+		while (headroom < 62 && !(m >> (62 - headroom)))
+			++headroom;
+		int pre = std::min(shift, headroom); // сколько можно сдвинуть до извлечения корня
+		if ((shift - pre) % 2 != 0)
+			--pre; // остаток сдвига делится пополам после извлечения корня
+		m = pre >= 0 ? m << pre : m >> -pre;
+		uint64_t x = m;
+		if (m > 1) {
+			int bits = 0;
+			while ((m >> bits) > 1)
+				++bits;
+			x = uint64_t(1) << (bits / 2 + 1); // начальное приближение сверху
+			for (uint64_t y = (x + m / x) / 2; y < x; y = (x + m / x) / 2)
+				x = y;
+		}
+		return rescale(int64_t(x), 0, (shift - pre) / 2, ok);
+	}
+
+	std::vector<std::string> variables_;
+	std::vector<Step> steps_;
+	int fracBits_;
+	int mode_;
+	int locals_;
+	int resultFrac_;
+	bool valid_;
+};
+
+
+struct Differentiate : Transformer { // производная по переменной name
+public:
+	Differentiate(std::string const& name) : name_(name), differentiable_(true) {}
+
+	// false, если в дереве встретились min или max: их производная в дереве заменена на NaN.
+	bool differentiable() const { return differentiable_; }
+
+	Expression* transformNumber(Number const*) {
+		return new Number(0.0);
+	}
+	Expression* transformBinaryOperation(BinaryOperation const* binop) {
+		Expression* dleft = (binop->left())->transform(this);
+		Expression* dright = (binop->right())->transform(this);
+		switch (binop->operation()) {
+		case BinaryOperation::PLUS:
+		case BinaryOperation::MINUS:
+			return new BinaryOperation(dleft, binop->operation(), dright);
+		case BinaryOperation::MUL: // (uv)' = u'v + uv'
+			return new BinaryOperation(new BinaryOperation(dleft, BinaryOperation::MUL, copy(binop->right())), BinaryOperation::PLUS,
+				new BinaryOperation(copy(binop->left()), BinaryOperation::MUL, dright));
+		default: // (u/v)' = (u'v - uv') / (v*v)
+			return new BinaryOperation(
+				new BinaryOperation(new BinaryOperation(dleft, BinaryOperation::MUL, copy(binop->right())), BinaryOperation::MINUS,
+					new BinaryOperation(copy(binop->left()), BinaryOperation::MUL, dright)),
+				BinaryOperation::DIV, new BinaryOperation(copy(binop->right()), BinaryOperation::MUL, copy(binop->right())));
+		}
+	}
+	Expression* transformFunctionCall(FunctionCall const* fcall) {
+		if (fcall->definition() && fcall->definition()->table) { // t(u)' = t'(u) u', где t' — таблица производной под именем t'
+			std::string name = FunctionRegistry::instance().derivative(fcall->name());
+			return new BinaryOperation(new FunctionCall(name, copy(fcall->arg())), BinaryOperation::MUL, (fcall->arg())->transform(this));
+		}
+		if (fcall->definition()) { // f(a, b)' дифференцируем как встроенное тело: let $0 = a in let $1 = b in let p = $0 in let q = $1 in body
+			FunctionRegistry::Definition const* definition = fcall->definition();
+			Expression const* inlined = copy(definition->body);
+			for (size_t i = definition->params.size(); i-- > 0; )
+				inlined = new Let(definition->params[i], new Variable("$" + std::to_string(i)), inlined);
+			for (size_t i = fcall->arity(); i-- > 0; ) // временные имена не дают аргументу увидеть уже связанный параметр
+				inlined = new Let("$" + std::to_string(i), copy(fcall->arg(i)), inlined);
+			Expression* result = inlined->transform(this);
+			delete inlined;
+			return result;
+		}
+		Expression* darg = (fcall->arg())->transform(this);
+		if (fcall->name() == "sqrt") // sqrt(u)' = u' / (2 sqrt(u))
+			return new BinaryOperation(darg, BinaryOperation::DIV, new BinaryOperation(new Number(2.0), BinaryOperation::MUL, copy(fcall)));
+		// abs(u)' = u' * u / abs(u)
+		return new BinaryOperation(new BinaryOperation(darg, BinaryOperation::MUL, copy(fcall->arg())), BinaryOperation::DIV, copy(fcall));
+	}
+	Expression* transformVariable(Variable const* var) {
+		if (std::find(bound_.begin(), bound_.end(), var->name()) != bound_.end())
+			return new Variable(var->name() + "'"); // производная имени из let хранится в парном let
+		return new Number(var->name() == name_ ? 1.0 : 0.0);
+	}
+	// (let n = v in b)' = let n' = v' in let n = v in b', где в b' ссылки на n заменены на n'.
+	// n' связывается первым, чтобы v и v' видели внешние привязки, а не новую n.
+	Expression* transformLet(Let const* let) {
+		Expression* dvalue = (let->value())->transform(this);
+		bound_.push_back(let->name());
+		Expression* dbody = (let->body())->transform(this);
+		bound_.pop_back();
+		return new Let(let->name() + "'", dvalue, new Let(let->name(), copy(let->value()), dbody));
+	}
+	Expression* transformReduction(Reduction const* reduction) { // дифференцируем по скаляру: производная суммы — сумма производных
+		Expression const* u = reduction->arg();
+		switch (reduction->kind()) {
+		case Reduction::SUM:
+			return new Reduction(Reduction::SUM, u->transform(this));
+		case Reduction::DOT: // dot(u, v)' = sum(u'v + uv')
+			return new Reduction(Reduction::SUM, new BinaryOperation(
+				new BinaryOperation(u->transform(this), BinaryOperation::MUL, copy(reduction->right())), BinaryOperation::PLUS,
+				new BinaryOperation(copy(u), BinaryOperation::MUL, (reduction->right())->transform(this))));
+		case Reduction::NORM: // norm(u)' = sum(u u') / norm(u)
+			return new BinaryOperation(new Reduction(Reduction::SUM, new BinaryOperation(copy(u), BinaryOperation::MUL, u->transform(this))),
+				BinaryOperation::DIV, copy(reduction));
+		default: // производная min и max зависит от номера крайнего элемента, которого нет в дереве
+			differentiable_ = false;
+			return new Number(std::numeric_limits<double>::quiet_NaN());
+		}
+	}
+
+private:
+	Expression* copy(Expression const* expr) { return expr->transform(&copy_); }
+
+	CopySyntaxTree copy_;
+	std::string const name_;
+	std::vector<std::string> bound_; // имена, связанные объемлющими let
+	bool differentiable_;
 };
 
 
-int main() {
+// Компактная копия дерева для многократного вычисления. Узлы лежат в одном массиве, а листья не занимают
+// узлов вовсе: слот потомка — 64-битное слово, которое либо само является числом double, либо несёт
+// в отрицательном NaN метку и номер имени или узла (NaN-boxing). Константы NaN приводятся к каноническому
+// положительному NaN, поэтому с метками не пересекаются.
+// Поддерживаются числа, переменные, арифметика, sqrt, abs и let; пользовательских функций и свёрток здесь нет.
+struct PackedTree {
+public:
+	struct Node {
+		uint64_t left;
+		uint64_t right; // у sqrt и abs не используется
+		uint32_t symbol; // имя, связываемое let
+		uint8_t kind; // операция BinaryOperation, Instruction::SQRT, ABS или STORE для let
+	};
+
+	enum {
+		PREORDER, // порядок построения: полный обход идёт по памяти подряд
+		BREADTH_FIRST, // по уровням
+		VAN_EMDE_BOAS // верхняя половина высоты, затем нижние поддеревья, и так рекурсивно: путь от корня к листу задевает O(log_B n) строк кэша
+	};
+
+	explicit PackedTree(Expression const* expr) { root_ = pack(expr); }
+
+	// Переставляет узлы в памяти в порядке layout. Значение дерева не меняется, меняется только близость узлов.
+	void relayout(int layout) {
+		if (!isNode(root_))
+			return;
+		std::vector<uint32_t> order; // старые номера узлов в новом порядке
+		order.reserve(nodes_.size());
+		uint32_t root = uint32_t(root_ & PAYLOAD);
+		if (layout == PREORDER) {
+			std::vector<uint32_t> stack(1, root);
+			while (!stack.empty()) {
+				uint32_t index = stack.back();
+				stack.pop_back();
+				order.push_back(index);
+				if (isNode(nodes_[index].right) && !unary(nodes_[index]))
+					stack.push_back(uint32_t(nodes_[index].right & PAYLOAD));
+				if (isNode(nodes_[index].left))
+					stack.push_back(uint32_t(nodes_[index].left & PAYLOAD));
+			}
+		}
+		else if (layout == BREADTH_FIRST) {
+			order.push_back(root);
+			for (size_t head = 0; head < order.size(); ++head) {
+				Node const& node = nodes_[order[head]];
+				if (isNode(node.left))
+					order.push_back(uint32_t(node.left & PAYLOAD));
+				if (isNode(node.right) && !unary(node))
+					order.push_back(uint32_t(node.right & PAYLOAD));
+			}
+		}
+		else {
+			assert(layout == VAN_EMDE_BOAS);
+			std::vector<int> heights(nodes_.size(), 0);
+			vanEmdeBoas(root, height(root, heights), order);
+		}
+		assert(order.size() == nodes_.size());
+		std::vector<uint32_t> position(nodes_.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			position[order[i]] = uint32_t(i);
+		std::vector<Node> nodes(nodes_.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			Node node = nodes_[order[i]];
+			node.left = moved(node.left, position);
+			if (!unary(node))
+				node.right = moved(node.right, position);
+			nodes[i] = node;
+		}
+		nodes_.swap(nodes);
+		root_ = moved(root_, position);
+	}
+
+	std::vector<std::string> const& symbols() const { return symbols_; } // имена переменных и let по номерам
+	int symbol(std::string const& name) const {
+		for (size_t i = 0; i < symbols_.size(); ++i)
+			if (symbols_[i] == name)
+				return int(i);
+		return -1;
+	}
+	size_t nodes() const { return nodes_.size(); }
+	size_t bytes() const { return nodes_.size() * sizeof(Node); }
+
+	// values[i] — значение symbols()[i] (как и у дерева, непривязанное имя равно 0).
+	// let на время тела подменяет значение своего имени и затем восстанавливает его.
+	double evaluate(std::vector<double>& values) const {
+		assert(values.size() == symbols_.size());
+		return value(root_, values.data());
+	}
+
+private:
+	enum : uint64_t {
+		TAG_SHIFT = 48,
+		VARIABLE = 0xFFF9, // метка слота-переменной, в младших битах номер имени
+		NODE = 0xFFFA, // метка слота-узла, в младших битах номер в nodes_
+		PAYLOAD = (uint64_t(1) << 48) - 1
+	};
+
+	static bool isNode(uint64_t slot) { return (slot >> TAG_SHIFT) == NODE; }
+	static bool unary(Node const& node) { return node.kind == Instruction::SQRT || node.kind == Instruction::ABS; }
+	static uint64_t moved(uint64_t slot, std::vector<uint32_t> const& position) {
+		return isNode(slot) ? (NODE << TAG_SHIFT) | position[slot & PAYLOAD] : slot;
+	}
+	int height(uint32_t index, std::vector<int>& heights) const { // высота по узлам; листья в слотах не считаются
+		Node const& node = nodes_[index];
+		int h = 0;
+		if (isNode(node.left))
+			h = height(uint32_t(node.left & PAYLOAD), heights);
+		if (isNode(node.right) && !unary(node))
+			h = std::max(h, height(uint32_t(node.right & PAYLOAD), heights));
+		return heights[index] = h + 1;
+	}
+	// Узлы поддерева index на глубинах меньше height: сначала верхние height / 2 уровней, затем каждое
+	// нижнее поддерево слева направо. Поддерево ниже своей доли высоты целиком уходит в верхнюю часть.
+	void vanEmdeBoas(uint32_t index, int height, std::vector<uint32_t>& order) const {
+		if (height == 1) {
+			order.push_back(index);
+			return;
+		}
+		int top = height / 2;
+		vanEmdeBoas(index, top, order);
+		std::vector<uint32_t> bottoms;
+		frontier(index, top, bottoms);
+		for (uint32_t bottom : bottoms)
+			vanEmdeBoas(bottom, height - top, order);
+	}
+	void frontier(uint32_t index, int depth, std::vector<uint32_t>& out) const { // узлы ровно на глубине depth, слева направо
+		if (depth == 0) {
+			out.push_back(index);
+			return;
+		}
+		Node const& node = nodes_[index];
+		if (isNode(node.left))
+			frontier(uint32_t(node.left & PAYLOAD), depth - 1, out);
+		if (isNode(node.right) && !unary(node))
+			frontier(uint32_t(node.right & PAYLOAD), depth - 1, out);
+	}
+	double value(uint64_t slot, double* values) const {
+		if ((slot >> TAG_SHIFT) < VARIABLE) { // обычное число: отдельного узла и промаха кэша нет
+			double number;
+			std::memcpy(&number, &slot, sizeof(number));
+			return number;
+		}
+		if ((slot >> TAG_SHIFT) == VARIABLE)
+			return values[slot & PAYLOAD];
+		Node const& node = nodes_[slot & PAYLOAD];
+		switch (node.kind) {
+		case BinaryOperation::PLUS: return value(node.left, values) + value(node.right, values);
+		case BinaryOperation::MINUS: return value(node.left, values) - value(node.right, values);
+		case BinaryOperation::MUL: return value(node.left, values) * value(node.right, values);
+		case BinaryOperation::DIV: return value(node.left, values) / value(node.right, values);
+		case Instruction::SQRT: return std::sqrt(value(node.left, values));
+		case Instruction::ABS: return std::fabs(value(node.left, values));
+		default: { // let
+			double bound = value(node.left, values);
+			std::swap(values[node.symbol], bound);
+			double result = value(node.right, values);
+			values[node.symbol] = bound;
+			return result;
+		}
+		}
+	}
+	uint32_t intern(std::string const& name) {
+		int index = symbol(name);
+		if (index < 0) {
+			symbols_.push_back(name);
+			index = int(symbols_.size()) - 1;
+		}
+		return uint32_t(index);
+	}
+	uint64_t pack(Expression const* expr) { // узлы в прямом порядке обхода
+		if (Number const* number = dynamic_cast<Number const*>(expr)) {
+			double value = number->value();
+			uint64_t slot;
+			std::memcpy(&slot, &value, sizeof(slot));
+			return value != value ? uint64_t(0x7FF8000000000000ull) : slot;
+		}
+		if (Variable const* var = dynamic_cast<Variable const*>(expr))
+			return (VARIABLE << TAG_SHIFT) | intern(var->name());
+		size_t index = nodes_.size();
+		nodes_.push_back(Node{ 0, 0, 0, 0 });
+		Node node = { 0, 0, 0, 0 };
+		if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			node.kind = uint8_t(binop->operation());
+			node.left = pack(binop->left());
+			node.right = pack(binop->right());
+		}
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) {
+			node.kind = uint8_t(Instruction::STORE);
+			node.symbol = intern(let->name());
+			node.left = pack(let->value());
+			node.right = pack(let->body());
+		}
+		else {
+			FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr);
+			assert(fcall && !fcall->definition()); // только встроенные sqrt и abs
+			node.kind = uint8_t(fcall->name() == "sqrt" ? Instruction::SQRT : Instruction::ABS);
+			node.left = pack(fcall->arg());
+		}
+		nodes_[index] = node;
+		return (NODE << TAG_SHIFT) | index;
+	}
+
+	std::vector<Node> nodes_;
+	std::vector<std::string> symbols_;
+	uint64_t root_;
+
+	friend struct TaskGraph;
+};
+
+
+// Параллельное вычисление одного большого упакованного дерева. Дерево режется по стоимости поддеревьев
+// (числу узлов): поддерево не дороже grain становится задачей-листом и считается целиком одним потоком,
+// а узел выше него — задачей-сборкой, которая ждёт счётчик незавершённых потомков и складывает их значения.
+// Задачи раздаются по очередям потоков; свободный поток забирает задачи с другого конца чужой очереди.
+// Тело let внутри не режется: оно читает значение let и считается при сборке узла let.
+// Дерево должно жить дольше TaskGraph; разбиение строится один раз и служит любым значениям переменных.
+struct TaskGraph {
+public:
+	enum {
+		GRAIN = 1 << 12, // наименьшая задача в узлах: меньше не окупает очередь и счётчик
+		TASKS_PER_THREAD = 16 // запас задач на поток, чтобы неровные ветви выравнивались воровством
+	};
+
+	explicit TaskGraph(PackedTree const& tree, unsigned threads = 0)
+		: tree_(tree), threads_(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {
+		if (!PackedTree::isNode(tree_.root_))
+			return;
+		std::vector<size_t> cost(tree_.nodes_.size()); // потомок лежит в массиве после родителя при любой раскладке
+		for (size_t i = cost.size(); i-- > 0; ) {
+			PackedTree::Node const& node = tree_.nodes_[i];
+			cost[i] = 1;
+			if (PackedTree::isNode(node.left))
+				cost[i] += cost[node.left & PackedTree::PAYLOAD];
+			if (PackedTree::isNode(node.right) && !PackedTree::unary(node))
+				cost[i] += cost[node.right & PackedTree::PAYLOAD];
+		}
+		size_t grain = std::max<size_t>(GRAIN, cost.size() / (size_t(threads_) * TASKS_PER_THREAD));
+		split(uint32_t(tree_.root_ & PackedTree::PAYLOAD), -1, cost, grain);
+	}
+
+	size_t tasks() const { return tasks_.size(); }
+
+	// values — как у PackedTree::evaluate; каждый поток работает со своей копией, так что let не мешают друг другу.
+	double evaluate(std::vector<double> const& values) const {
+		assert(values.size() == tree_.symbols().size());
+		if (tasks_.size() <= 1 || threads_ == 1) {
+			std::vector<double> local(values);
+			return tree_.evaluate(local);
+		}
+		std::vector<double> results(tasks_.size());
+		std::unique_ptr<std::atomic<int>[]> pending(new std::atomic<int>[tasks_.size()]);
+		std::vector<int> leaves;
+		for (size_t i = 0; i < tasks_.size(); ++i) {
+			pending[i].store(tasks_[i].dependencies, std::memory_order_relaxed);
+			if (tasks_[i].dependencies == 0)
+				leaves.push_back(int(i));
+		}
+		std::vector<Queue> queues(threads_);
+		for (size_t i = 0; i < leaves.size(); ++i) // соседние по дереву листья — одному потоку
+			queues[i * threads_ / leaves.size()].tasks.push_back(leaves[i]);
+		std::atomic<bool> done(false);
+		auto worker = [&](unsigned self) {
+			std::vector<double> local(values);
+			while (!done.load(std::memory_order_acquire)) {
+				int task;
+				if (!take(queues, self, task)) {
+					std::this_thread::yield();
+					continue;
+				}
+				results[task] = run(tasks_[task], results, local);
+				int parent = tasks_[task].parent;
+				if (parent < 0)
+					done.store(true, std::memory_order_release);
+				else if (pending[parent].fetch_sub(1, std::memory_order_acq_rel) == 1) { // последний потомок запускает сборку
+					std::lock_guard<std::mutex> lock(queues[self].mutex);
+					queues[self].tasks.push_back(parent);
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < threads_; ++t)
+			pool.emplace_back(worker, t);
+		worker(0);
+		for (std::thread& th : pool)
+			th.join();
+		return results[0];
+	}
+
+private:
+	struct Task {
+		uint32_t node;
+		int left; // задачи потомков; -1 — слот считается на месте
+		int right;
+		int parent;
+		int dependencies; // 0 — лист: всё поддерево одним вызовом
+	};
+	struct Queue {
+		std::mutex mutex;
+		std::deque<int> tasks; // владелец берёт с конца, воры — с начала
+	};
+
+	int split(uint32_t index, int parent, std::vector<size_t> const& cost, size_t grain) {
+		int task = int(tasks_.size());
+		tasks_.push_back(Task{ index, -1, -1, parent, 0 });
+		if (cost[index] <= grain)
+			return task;
+		PackedTree::Node const& node = tree_.nodes_[index];
+		if (PackedTree::isNode(node.left)) {
+			int left = split(uint32_t(node.left & PackedTree::PAYLOAD), task, cost, grain);
+			tasks_[task].left = left;
+			++tasks_[task].dependencies;
+		}
+		if (PackedTree::isNode(node.right) && !PackedTree::unary(node) && node.kind != Instruction::STORE) {
+			int right = split(uint32_t(node.right & PackedTree::PAYLOAD), task, cost, grain);
+			tasks_[task].right = right;
+			++tasks_[task].dependencies;
+		}
+		return task;
+	}
+	static bool take(std::vector<Queue>& queues, unsigned self, int& task) {
+		{
+			std::lock_guard<std::mutex> lock(queues[self].mutex);
+			if (!queues[self].tasks.empty()) {
+				task = queues[self].tasks.back();
+				queues[self].tasks.pop_back();
+				return true;
+			}
+		}
+		for (size_t k = 1; k < queues.size(); ++k) {
+			Queue& victim = queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+	double run(Task const& task, std::vector<double> const& results, std::vector<double>& local) const {
+		uint64_t slot = (uint64_t(PackedTree::NODE) << PackedTree::TAG_SHIFT) | task.node;
+		if (task.dependencies == 0)
+			return tree_.value(slot, local.data());
+		PackedTree::Node const& node = tree_.nodes_[task.node];
+		double left = task.left >= 0 ? results[task.left] : tree_.value(node.left, local.data());
+		if (node.kind == Instruction::STORE) { // let: тело целиком здесь, при своём значении имени
+			std::swap(local[node.symbol], left);
+			double result = tree_.value(node.right, local.data());
+			local[node.symbol] = left;
+			return result;
+		}
+		if (PackedTree::unary(node))
+			return node.kind == Instruction::SQRT ? std::sqrt(left) : std::fabs(left);
+		double right = task.right >= 0 ? results[task.right] : tree_.value(node.right, local.data());
+		switch (node.kind) {
+		case BinaryOperation::PLUS: return left + right;
+		case BinaryOperation::MINUS: return left - right;
+		case BinaryOperation::MUL: return left * right;
+		default: return left / right;
+		}
+	}
+
+	PackedTree const& tree_;
+	unsigned const threads_;
+	std::vector<Task> tasks_; // в прямом порядке: корень — задача 0
+};
+
+
+// Решение f(x) = target построчно для целого пакета строк.
+// Ньютон с защитой: корень держится в скобке, и шаг, выходящий за неё, заменяется делением пополам.
+// Там, где производная не определена (NaN, например у min и max), шаг всегда — деление пополам.
+// Значение f - target, равное NaN или бесконечности, не говорит, по какую сторону корня лежит точка, поэтому строка
+// с таким значением на конце скобки или в очередном приближении считается несошедшейся.
+// Сошедшиеся строки выбрасываются из списка активных, так что каждая итерация стоит пропорционально оставшимся строкам.
+struct NewtonSolver {
+public:
+	NewtonSolver(Expression const* f, std::string const& x, double tolerance = 1e-12, int maxIterations = 100)
+		: x_(x), tolerance_(tolerance), maxIterations_(maxIterations) {
+		Compiler compiler;
+		f_ = compiler.compile(f);
+		Differentiate differentiate(x);
+		FoldConstants fold;
+		Expression* df = f->transform(&differentiate);
+		Expression* folded = df->transform(&fold);
+		df_ = compiler.compile(folded);
+		delete df;
+		delete folded;
+		for (Program const* program : { &f_, &df_ })
+			for (std::string const& name : program->variables)
+				if (name != x_ && std::find(variables_.begin(), variables_.end(), name) == variables_.end())
+					variables_.push_back(name);
+	}
+
+	std::vector<std::string> const& variables() const { return variables_; } // порядок столбцов остальных переменных
+
+	// Для каждой строки ищет корень в скобке [lo[i], hi[i]]; возвращает число сошедшихся строк,
+	// у остальных (нет смены знака на концах скобки, f не конечна в пройденной точке или не хватило итераций) root[i] = NaN.
+	size_t solve(std::vector<double const*> const& columns, double const* target, double const* lo, double const* hi,
+		size_t n, double* root) const {
+		assert(columns.size() == variables_.size());
+		std::vector<double> glo(n), ghi(n);
+		evaluate(f_, columns, lo, n, glo.data());
+		evaluate(f_, columns, hi, n, ghi.data());
+		std::vector<double> neg(n), pos(n); // концы скобки, где f - target < 0 и > 0
+		std::vector<size_t> active;
+		size_t converged = 0;
+		for (size_t i = 0; i < n; ++i) {
+			double a = glo[i] - target[i], b = ghi[i] - target[i];
+			root[i] = std::numeric_limits<double>::quiet_NaN();
+			if (!finite(a) || !finite(b))
+				continue;
+			if (a == 0.0 || b == 0.0) {
+				root[i] = a == 0.0 ? lo[i] : hi[i];
+				++converged;
+			}
+			else if ((a < 0.0) != (b < 0.0)) {
+				neg[i] = a < 0.0 ? lo[i] : hi[i];
+				pos[i] = a < 0.0 ? hi[i] : lo[i];
+				root[i] = 0.5 * (lo[i] + hi[i]);
+				active.push_back(i);
+			}
+		}
+		std::vector<double> x, value(n), slope(n);
+		std::vector<std::vector<double>> gathered(variables_.size());
+		std::vector<double const*> compact(variables_.size());
+		for (int iteration = 0; iteration < maxIterations_ && !active.empty(); ++iteration) {
+			size_t m = active.size();
+			x.resize(m);
+			for (size_t k = 0; k < m; ++k)
+				x[k] = root[active[k]];
+			for (size_t j = 0; j < variables_.size(); ++j) { // сбор входов активных строк в плотные столбцы
+				gathered[j].resize(m);
+				for (size_t k = 0; k < m; ++k)
+					gathered[j][k] = columns[j][active[k]];
+				compact[j] = gathered[j].data();
+			}
+			evaluate(f_, compact, x.data(), m, value.data());
+			evaluate(df_, compact, x.data(), m, slope.data());
+			size_t kept = 0;
+			for (size_t k = 0; k < m; ++k) {
+				size_t i = active[k];
+				double g = value[k] - target[i];
+				if (g == 0.0) {
+					++converged;
+					continue;
+				}
+				if (!finite(g)) { // сторона скобки неизвестна; деление пополам без сдвига концов стояло бы на месте
+					root[i] = std::numeric_limits<double>::quiet_NaN();
+					continue;
+				}
+				(g < 0.0 ? neg[i] : pos[i]) = x[k];
+				double left = std::min(neg[i], pos[i]), right = std::max(neg[i], pos[i]);
+				double next = x[k] - g / slope[k];
+				if (!(next > left && next < right)) // шаг Ньютона вышел из скобки или не определён
+					next = 0.5 * (left + right);
+				root[i] = next;
+				if (std::fabs(next - x[k]) <= tolerance_ * (1.0 + std::fabs(next)) || right - left <= tolerance_ * (1.0 + std::fabs(next)))
+					++converged;
+				else
+					active[kept++] = i;
+			}
+			active.resize(kept);
+		}
+		for (size_t i : active)
+			root[i] = std::numeric_limits<double>::quiet_NaN();
+		return converged;
+	}
+
+private:
+	static bool finite(double v) { return std::fabs(v) <= std::numeric_limits<double>::max(); }
+	// Вычисляет программу, подставляя x вместо искомой переменной и столбцы остальных переменных.
+	void evaluate(Program const& program, std::vector<double const*> const& columns, double const* x,
+		size_t n, double* out) const {
+		std::vector<double const*> bound(program.variables.size());
+		for (size_t i = 0; i < bound.size(); ++i)
+			bound[i] = program.variables[i] == x_ ? x
+				: columns[std::find(variables_.begin(), variables_.end(), program.variables[i]) - variables_.begin()];
+		program.run(bound, n, out);
+	}
+
+	std::string const x_;
+	double tolerance_;
+	int maxIterations_;
+	Program f_;
+	Program df_;
+	std::vector<std::string> variables_;
+};
+
+
+struct Philox { // счётный генератор Philox4x32-10: выход зависит только от (ключа, счётчика)
+public:
+	Philox(uint64_t seed) : key0_(uint32_t(seed)), key1_(uint32_t(seed >> 32)) {}
+
+	void generate(uint32_t counter[4]) const { // заменяет счётчик четырьмя случайными словами
+		uint32_t k0 = key0_, k1 = key1_;
+		for (int round = 0; round < 10; ++round) {
+			uint64_t p0 = uint64_t(0xD2511F53u) * counter[0];
+			uint64_t p1 = uint64_t(0xCD9E8D57u) * counter[2];
+			uint32_t c[4] = { uint32_t(p1 >> 32) ^ counter[1] ^ k0, uint32_t(p1), uint32_t(p0 >> 32) ^ counter[3] ^ k1, uint32_t(p0) };
+			std::copy(c, c + 4, counter);
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+	}
+	// Два равномерных числа из (0, 1) для пары (поток, номер) — 53 бита на каждое.
+	void uniforms(uint64_t index, uint32_t stream, double& u, double& v) const {
+		uint32_t c[4] = { uint32_t(index), uint32_t(index >> 32), stream, 0 };
+		generate(c);
+		u = ((uint64_t(c[0]) << 21 ^ c[1] >> 11) + 0.5) * 0x1p-53;
+		v = ((uint64_t(c[2]) << 21 ^ c[3] >> 11) + 0.5) * 0x1p-53;
+	}
+
+private:
+	uint32_t key0_;
+	uint32_t key1_;
+};
+
+
+struct LogHistogram { // гистограмма с логарифмическими корзинами: относительная ошибка квантиля около 2^-SUB_BITS
+public:
+	enum {
+		SUB_BITS = 7, // корзин на каждую двоичную декаду
+		MIN_EXP = -64, // меньшие по модулю значения попадают в первую корзину
+		MAX_EXP = 64 // большие — в последнюю
+	};
+
+	LogHistogram() : counts_(2 * BUCKETS), zeros_(0), nans_(0) {}
+
+	void add(double v) {
+		if (v != v)
+			++nans_;
+		else if (v == 0.0)
+			++zeros_;
+		else
+			++counts_[v < 0.0 ? BUCKETS - 1 - bucket(-v) : BUCKETS + bucket(v)];
+	}
+	void merge(LogHistogram const& other) { // сложение счётчиков не зависит от порядка слияния
+		for (size_t i = 0; i < counts_.size(); ++i)
+			counts_[i] += other.counts_[i];
+		zeros_ += other.zeros_;
+		nans_ += other.nans_;
+	}
+	uint64_t count() const { // число значений без NaN
+		uint64_t total = zeros_;
+		for (uint64_t c : counts_)
+			total += c;
+		return total;
+	}
+	uint64_t nans() const { return nans_; }
+	double quantile(double q) const { // середина корзины, содержащей q-квантиль
+		uint64_t total = count();
+		if (total == 0)
+			return std::numeric_limits<double>::quiet_NaN();
+		uint64_t rank = uint64_t(q * double(total - 1)), seen = 0;
+		for (size_t i = 0; i < counts_.size(); ++i) {
+			if (i == size_t(BUCKETS)) { // нули стоят между отрицательными и положительными корзинами
+				seen += zeros_;
+				if (seen > rank)
+					return 0.0;
+			}
+			seen += counts_[i];
+			if (seen > rank)
+				return i < size_t(BUCKETS) ? -middle(BUCKETS - 1 - int(i)) : middle(int(i) - BUCKETS);
+		}
+		return middle(BUCKETS - 1);
+	}
+
+private:
+	enum { BUCKETS = (MAX_EXP - MIN_EXP) << SUB_BITS };
+
+	static int bucket(double v) { // v > 0
+		int e;
+		double m = std::frexp(v, &e); // v = m * 2^e, m из [0.5, 1)
+		if (e <= MIN_EXP)
+			return 0;
+		if (e > MAX_EXP)
+			return BUCKETS - 1;
+		return ((e - 1 - MIN_EXP) << SUB_BITS) + int((m * 2.0 - 1.0) * (1 << SUB_BITS));
+	}
+	static double middle(int b) {
+		int e = (b >> SUB_BITS) + MIN_EXP;
+		double m = 1.0 + ((b & ((1 << SUB_BITS) - 1)) + 0.5) / (1 << SUB_BITS);
+		return std::ldexp(m, e);
+	}
+
+	std::vector<uint64_t> counts_;
+	uint64_t zeros_;
+	uint64_t nans_;
+};
+
+
+// Гистограмма задержек в наносекундах: только положительный диапазон от 1 нс до 2^MAX_EXP нс (около 18 минут),
+// 2^SUB_BITS корзин на двоичную декаду — ошибка квантиля до 6%. Всего 320 счётчиков, 2.5 КБ: копия и слияние дёшевы.
+struct LatencyHistogram {
+public:
+	enum {
+		SUB_BITS = 3,
+		MAX_EXP = 40 // большие значения попадают в последнюю корзину, меньшие 1 нс — в первую
+	};
+
+	LatencyHistogram() : counts_(), sum_(0.0) {}
+
+	void add(double nanoseconds) {
+		++counts_[bucket(nanoseconds)];
+		sum_ += nanoseconds;
+	}
+	void merge(LatencyHistogram const& other) {
+		for (int i = 0; i < BUCKETS; ++i)
+			counts_[i] += other.counts_[i];
+		sum_ += other.sum_;
+	}
+	double sum() const { return sum_; } // точная сумма значений, не по корзинам
+	uint64_t count() const {
+		uint64_t total = 0;
+		for (uint64_t c : counts_)
+			total += c;
+		return total;
+	}
+	double quantile(double q) const { // середина корзины, содержащей q-квантиль
+		uint64_t total = count();
+		if (total == 0)
+			return std::numeric_limits<double>::quiet_NaN();
+		uint64_t rank = uint64_t(q * double(total - 1)), seen = 0;
+		for (int i = 0; i < BUCKETS; ++i) {
+			seen += counts_[i];
+			if (seen > rank)
+				return middle(i);
+		}
+		return middle(BUCKETS - 1);
+	}
+
+private:
+	enum { BUCKETS = MAX_EXP << SUB_BITS };
+
+	static int bucket(double v) {
+		if (!(v >= 1.0))
+			return 0;
+		int e;
+		double m = std::frexp(v, &e); // v = m * 2^e, m из [0.5, 1), e >= 1
+		if (e > MAX_EXP)
+			return BUCKETS - 1;
+		return ((e - 1) << SUB_BITS) + int((m * 2.0 - 1.0) * (1 << SUB_BITS));
+	}
+	static double middle(int b) {
+		double m = 1.0 + ((b & ((1 << SUB_BITS) - 1)) + 0.5) / (1 << SUB_BITS);
+		return std::ldexp(m, b >> SUB_BITS);
+	}
+
+	uint64_t counts_[BUCKETS];
+	double sum_;
+};
+
+
+// Метрики движка: задержки путей вычисления в потоковых гистограммах, сливаемых по запросу, и счётчики событий.
+// Выгружаются в текстовом формате Prometheus в файл или в локальный сокет.
+struct Metrics {
+public:
+	enum { // пути вычисления
+		SCALAR,
+		BATCH,
+		COMPILE,
+		PATHS
+	};
+	enum { // счётчики
+		CACHE_HITS,
+		COMPILES,
+		ALLOCATIONS,
+		DOMAIN_ERRORS, // результаты NaN
+		RESULT_HITS, // попадания в ResultCache
+		RESULT_MISSES,
+		RESULT_EVICTIONS, // вытеснения по LRU и истечения срока
+		COUNTERS
+	};
+
+	static Metrics& instance() {
+		static Metrics metrics;
+		return metrics;
+	}
+
+	std::atomic<bool> enabled;
+
+	void record(int path, uint64_t nanoseconds) { // свой поток — своя гистограмма, блокировка без конкуренции
+		Local& local = this->local();
+		std::lock_guard<std::mutex> lock(local.mutex);
+		local.latency[path].add(double(nanoseconds));
+	}
+	void count(int counter, uint64_t n = 1) { counters_[counter].fetch_add(n, std::memory_order_relaxed); }
+	uint64_t counter(int counter) const { return counters_[counter]; }
+
+	double evaluate(Expression const* expr) { // скалярное вычисление с замером
+		if (!enabled)
+			return expr->evaluate();
+		auto start = std::chrono::steady_clock::now();
+		double result = expr->evaluate();
+		record(SCALAR, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+		if (result != result)
+			count(DOMAIN_ERRORS);
+		return result;
+	}
+
+	LatencyHistogram latency(int path) const { // слияние гистограмм всех потоков
+		LatencyHistogram merged;
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (std::shared_ptr<Local> const& local : threads_) {
+			std::lock_guard<std::mutex> guard(local->mutex);
+			merged.merge(local->latency[path]);
+		}
+		return merged;
+	}
+
+	void writePrometheus(std::ostream& out) const {
+		static char const* const paths[PATHS] = { "scalar", "batch", "compile" };
+		static char const* const counters[COUNTERS] = { "cache_hits", "compiles", "allocations", "domain_errors",
+			"result_hits", "result_misses", "result_evictions" };
+		out << "# TYPE formula_latency_seconds summary" << std::endl;
+		for (int p = 0; p < PATHS; ++p) {
+			LatencyHistogram h = latency(p);
+			for (double q : { 0.5, 0.99, 0.999 })
+				out << "formula_latency_seconds{path=\"" << paths[p] << "\",quantile=\"" << q << "\"} "
+					<< (h.count() ? h.quantile(q) * 1e-9 : 0.0) << std::endl;
+			out << "formula_latency_seconds_sum{path=\"" << paths[p] << "\"} " << h.sum() * 1e-9 << std::endl;
+			out << "formula_latency_seconds_count{path=\"" << paths[p] << "\"} " << h.count() << std::endl;
+		}
+		for (int c = 0; c < COUNTERS; ++c) {
+			out << "# TYPE formula_" << counters[c] << "_total counter" << std::endl;
+			out << "formula_" << counters[c] << "_total " << counter(c) << std::endl;
+		}
+	}
+	bool writeFile(std::string const& path) const { // через временный файл, чтобы сборщик не прочитал половину
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary);
+			writePrometheus(out);
+			if (!out)
+				return false;
+		}
+		return std::rename(temporary.c_str(), path.c_str()) == 0;
+	}
+	bool writeSocket(std::string const& path) const { // отправка в локальный (unix) сокет
+#ifdef __linux__
+		std::ostringstream text;
+		writePrometheus(text);
+		std::string const data = text.str();
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path))
+			return false;
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return false;
+		bool ok = connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+		for (size_t sent = 0; ok && sent < data.size(); ) {
+			ssize_t n = ::write(fd, data.data() + sent, data.size() - sent);
+			ok = n > 0;
+			sent += ok ? size_t(n) : 0;
+		}
+		close(fd);
+		return ok;
+#else
+		return false;
+#endif
+	}
+
+private:
+	struct Local {
+		std::mutex mutex;
+		LatencyHistogram latency[PATHS];
+	};
+
+	Metrics() : enabled(false) {
+		for (std::atomic<uint64_t>& c : counters_)
+			c = 0;
+	}
+	Local& local() { // гистограммы потока живут в реестре и после его завершения
+		thread_local std::shared_ptr<Local> local;
+		if (!local) {
+			local = std::make_shared<Local>();
+			std::lock_guard<std::mutex> lock(mutex_);
+			threads_.push_back(local);
+		}
+		return *local;
+	}
+
+	std::atomic<uint64_t> counters_[COUNTERS];
+	mutable std::mutex mutex_;
+	std::vector<std::shared_ptr<Local>> threads_;
+};
+
+
+struct Distribution { // закон распределения переменной в режиме Монте-Карло
+	enum {
+		CONSTANT, // всегда a
+		UNIFORM, // равномерное на [a, b)
+		NORMAL // нормальное со средним a и отклонением b
+	};
+	int kind;
+	double a;
+	double b;
+};
+
+
+struct MonteCarloResult {
+	uint64_t samples; // число конечных результатов
+	double mean;
+	double variance;
+	LogHistogram histogram;
+
+	double quantile(double q) const { return histogram.quantile(q); }
+};
+
+
+// Вычисление выражения, часть переменных которого — случайные величины.
+// Выборка делится на блоки фиксированного размера; номер блока и номер строки однозначно задают счётчик Philox,
+// а итоги блоков сливаются в порядке номеров, поэтому результат зависит только от seed, но не от числа потоков.
+struct MonteCarlo {
+public:
+	enum { SAMPLE_BLOCK = 4096 };
+
+	MonteCarlo(Expression const* expr) : program_(Compiler().compile(expr)) {
+		distributions_.assign(program_.variables.size(), Distribution{ Distribution::CONSTANT, 0.0, 0.0 });
+	}
+
+	void bind(std::string const& name, Distribution const& distribution) {
+		int index = program_.variableIndex(name);
+		if (index >= 0)
+			distributions_[index] = distribution;
+	}
+
+	MonteCarloResult run(uint64_t samples, uint64_t seed, unsigned threads = 0) const {
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		size_t blocks = size_t((samples + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK);
+		std::vector<Moments> moments(blocks);
+		std::vector<LogHistogram> histograms(threads);
+		std::atomic<size_t> next(0);
+		Philox rng(seed);
+		std::vector<double> const reduced = program_.reduce(); // массивы свёрток есть только в Environment этого потока
+		auto worker = [&](unsigned t) {
+			std::vector<std::vector<double>> columns(program_.variables.size(), std::vector<double>(SAMPLE_BLOCK));
+			std::vector<double const*> bound(columns.size());
+			std::vector<double> out(SAMPLE_BLOCK);
+			Program::Scratch scratch;
+			for (size_t block; (block = next++) < blocks; ) {
+				uint64_t first = uint64_t(block) * SAMPLE_BLOCK;
+				size_t m = size_t(std::min<uint64_t>(SAMPLE_BLOCK, samples - first));
+				for (size_t j = 0; j < columns.size(); ++j) {
+					sample(rng, distributions_[j], uint32_t(j), first, m, columns[j].data());
+					bound[j] = columns[j].data();
+				}
+				program_.run(bound, m, out.data(), program_.constants.data(), reduced.data(), scratch);
+				Moments& mo = moments[block];
+				for (size_t i = 0; i < m; ++i) {
+					histograms[t].add(out[i]);
+					if (std::isfinite(out[i])) { // Уэлфорд внутри блока
+						double delta = out[i] - mo.mean;
+						mo.mean += delta / double(++mo.count);
+						mo.m2 += delta * (out[i] - mo.mean);
+					}
+				}
+			}
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < threads; ++t)
+			pool.emplace_back(worker, t);
+		worker(0);
+		for (std::thread& th : pool)
+			th.join();
+
+		Moments total;
+		for (Moments const& mo : moments) { // слияние по Чану строго в порядке блоков
+			if (mo.count == 0)
+				continue;
+			uint64_t count = total.count + mo.count;
+			double delta = mo.mean - total.mean;
+			total.mean += delta * double(mo.count) / double(count);
+			total.m2 += mo.m2 + delta * delta * double(total.count) * double(mo.count) / double(count);
+			total.count = count;
+		}
+		MonteCarloResult result;
+		result.samples = total.count;
+		result.mean = total.mean;
+		result.variance = total.count > 1 ? total.m2 / double(total.count - 1) : 0.0;
+		for (LogHistogram const& h : histograms)
+			result.histogram.merge(h);
+		return result;
+	}
+
+private:
+	struct Moments {
+		uint64_t count = 0;
+		double mean = 0.0;
+		double m2 = 0.0;
+	};
+
+	static void sample(Philox const& rng, Distribution const& d, uint32_t stream, uint64_t first, size_t m, double* out) {
+		if (d.kind == Distribution::CONSTANT) {
+			std::fill(out, out + m, d.a);
+			return;
+		}
+		for (size_t i = 0; i < m; ++i) {
+			double u, v;
+			rng.uniforms(first + i, stream, u, v);
+			if (d.kind == Distribution::UNIFORM)
+				out[i] = d.a + (d.b - d.a) * u;
+			else // Бокс — Мюллер
+				out[i] = d.a + d.b * std::sqrt(-2.0 * std::log(u)) * std::cos(6.283185307179586 * v);
+		}
+	}
+
+	Program program_;
+	std::vector<Distribution> distributions_;
+};
+
+
+// Кооперативная отмена: кто-то вызывает cancel() или наступает срок. Вычислитель проверяет признак
+// на границах морселей, поэтому после отмены каждый поток доделывает не больше одного морселя.
+struct CancellationToken {
+public:
+	CancellationToken() : cancelled_(false), deadline_(std::chrono::steady_clock::time_point::max()) {}
+	explicit CancellationToken(std::chrono::steady_clock::duration timeout)
+		: cancelled_(false), deadline_(std::chrono::steady_clock::now() + timeout) {}
+
+	void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+	bool stopped() const {
+		return cancelled_.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() >= deadline_;
+	}
+
+private:
+	std::atomic<bool> cancelled_;
+	std::chrono::steady_clock::time_point const deadline_;
+};
+
+
+// Пакетное вычисление одной программы на нескольких потоках: значения по строкам и их сумма.
+// Строки считаются независимо, поэтому run побитово одинаков при любом числе потоков в обоих режимах.
+// Сумма в режиме FAST копится в потоке по тем кускам, что ему достались, и итог зависит от расписания.
+// В режиме DETERMINISTIC строки режутся на морсели фиксированного размера, частичная сумма морселя
+// считается одинаковым кодом от его начала, а морсели складываются попарным деревом в порядке номеров:
+// результат зависит только от данных. Слияния в fma для всего файла отключены (см. EXPRESSION_FP_CONTRACT).
+struct ParallelBatch {
+public:
+	enum {
+		FAST,
+		DETERMINISTIC
+	};
+	enum { MORSEL = 64 * Program::BLOCK }; // строк в морселе; от числа потоков не зависит
+
+	ParallelBatch(Program const& program, int mode = DETERMINISTIC, unsigned threads = 0)
+		: program_(program), mode_(mode), threads_(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+	void run(std::vector<double const*> const& columns, size_t n, double* out) const {
+		run(columns, n, out, nullptr);
+	}
+	double sum(std::vector<double const*> const& columns, size_t n) const {
+		double total = 0.0;
+		sum(columns, n, total, nullptr);
+		return total;
+	}
+	// С отменой: false, если token сработал до конца вычисления; тогда out заполнен лишь частично, а total не задан.
+	bool run(std::vector<double const*> const& columns, size_t n, double* out, CancellationToken const* token) const {
+		std::vector<double> const reduced = program_.reduce();
+		return parallel((n + MORSEL - 1) / MORSEL, token, [&](size_t morsel, Worker& worker) {
+			size_t base = morsel * MORSEL;
+			for (size_t j = 0; j < columns.size(); ++j)
+				worker.shifted[j] = columns[j] + base;
+			program_.run(worker.shifted, std::min<size_t>(MORSEL, n - base), out + base, program_.constants.data(), reduced.data(), worker.scratch);
+			return true;
+		});
+	}
+	bool sum(std::vector<double const*> const& columns, size_t n, double& total, CancellationToken const* token) const {
+		size_t morsels = (n + MORSEL - 1) / MORSEL;
+		std::vector<double> const reduced = program_.reduce();
+		if (mode_ == FAST) { // крупные куски по числу потоков, частичные суммы — в порядке завершения
+			total = 0.0;
+			std::mutex mutex;
+			size_t rows = (n + threads_ - 1) / threads_;
+			return parallel(threads_, token, [&](size_t part, Worker& worker) {
+				double partial = 0.0;
+				for (size_t base = part * rows; base < std::min(n, (part + 1) * rows); base += MORSEL) {
+					if (token && token->stopped())
+						return false;
+					size_t m = std::min({ size_t(MORSEL), n - base, (part + 1) * rows - base });
+					for (size_t j = 0; j < columns.size(); ++j)
+						worker.shifted[j] = columns[j] + base;
+					program_.run(worker.shifted, m, worker.out.data(), program_.constants.data(), reduced.data(), worker.scratch);
+					partial += add(worker.out.data(), m);
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				total += partial;
+				return true;
+			});
+		}
+		std::vector<double> partials(morsels, 0.0);
+		bool finished = parallel(morsels, token, [&](size_t morsel, Worker& worker) {
+			size_t base = morsel * MORSEL, m = std::min<size_t>(MORSEL, n - base);
+			for (size_t j = 0; j < columns.size(); ++j)
+				worker.shifted[j] = columns[j] + base;
+			program_.run(worker.shifted, m, worker.out.data(), program_.constants.data(), reduced.data(), worker.scratch);
+			partials[morsel] = add(worker.out.data(), m);
+			return true;
+		});
+		if (!finished)
+			return false;
+		for (size_t width = 1; width < morsels; width *= 2) // попарное дерево: форма зависит только от n
+			for (size_t i = 0; i + width < morsels; i += 2 * width)
+				partials[i] += partials[i + width];
+		total = morsels ? partials[0] : 0.0;
+		return true;
+	}
+
+private:
+	struct Worker { // буферы потока: столбцы со сдвигом, строки морселя и стек программы
+		std::vector<double const*> shifted;
+		std::vector<double> out;
+		Program::Scratch scratch;
+	};
+
+	static double add(double const* values, size_t m) { // четыре независимых цепочки, слитые в фиксированном порядке
+		enum { ACCUMULATORS = 4 };
+		double acc[ACCUMULATORS] = { 0.0, 0.0, 0.0, 0.0 };
+		size_t i = 0;
+		for (; i + ACCUMULATORS <= m; i += ACCUMULATORS)
+			for (int k = 0; k < ACCUMULATORS; ++k)
+				acc[k] += values[i + k];
+		for (; i < m; ++i)
+			acc[0] += values[i];
+		return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+	}
+	// body(номер, буферы потока) для каждого номера из [0, count); номера раздаются динамически.
+	// Перед каждым номером проверяется token; body возвращает false, если остановился сам. Итог — всё ли сделано.
+	// Свёртки читают Environment вызывающего потока, поэтому run и sum считают их до запуска потоков.
+	template <class Body>
+	bool parallel(size_t count, CancellationToken const* token, Body body) const {
+		std::atomic<size_t> next(0);
+		std::atomic<bool> stopped(false);
+		auto worker = [&]() {
+			Worker buffers;
+			buffers.shifted.resize(program_.variables.size());
+			buffers.out.resize(MORSEL);
+			for (size_t i; !stopped.load(std::memory_order_relaxed) && (i = next++) < count; )
+				if ((token && token->stopped()) || !body(i, buffers))
+					stopped.store(true, std::memory_order_relaxed);
+		};
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < std::min<size_t>(threads_, count); ++t)
+			pool.emplace_back(worker);
+		worker();
+		for (std::thread& th : pool)
+			th.join();
+		return !stopped.load();
+	}
+
+	Program const program_;
+	int const mode_;
+	unsigned const threads_;
+};
+
+
+// Много программ над общим набором столбцов. Если гнать каждую программу по всем строкам, входы
+// вытесняются из кэша и читаются из памяти заново для каждой формулы. Здесь строки режутся на плитки,
+// и все программы проходят плитку, пока её входы лежат в L1/L2, прежде чем перейти к следующей.
+// Лучший размер плитки зависит от машины и набора формул: autotune выбирает его замером.
+struct TiledBatch {
+public:
+	enum { TILE = 16 * Program::BLOCK }; // начальный размер плитки до autotune
+
+	// names — имена столбцов; переменные каждой программы должны быть среди них.
+	TiledBatch(std::vector<Program const*> const& programs, std::vector<std::string> const& names)
+		: programs_(programs), tile_(TILE) {
+		for (Program const* program : programs_) {
+			std::vector<size_t> index;
+			for (std::string const& variable : program->variables) {
+				size_t i = std::find(names.begin(), names.end(), variable) - names.begin();
+				assert(i < names.size());
+				index.push_back(i);
+			}
+			indices_.push_back(index);
+		}
+	}
+
+	// outs[p] — n результатов программы p.
+	void run(std::vector<double const*> const& columns, size_t n, std::vector<double*> const& outs) const {
+		run(columns, n, outs, tile_);
+	}
+	// Перебирает размеры плиток от BLOCK до 256 * BLOCK на первых строках (не больше SAMPLE) и запоминает самый
+	// быстрый. outs на этих строках заполняются настоящими результатами.
+	size_t autotune(std::vector<double const*> const& columns, size_t n, std::vector<double*> const& outs) {
+		enum { SAMPLE = 1 << 18, REPEAT = 3 };
+		size_t sample = std::min<size_t>(n, SAMPLE);
+		double best = std::numeric_limits<double>::infinity();
+		for (size_t tile = Program::BLOCK; tile <= 256 * size_t(Program::BLOCK); tile *= 2) {
+			double fastest = std::numeric_limits<double>::infinity();
+			for (int r = 0; r < REPEAT; ++r) { // лучший из повторов: меньше шума от соседей по машине
+				auto start = std::chrono::steady_clock::now();
+				run(columns, sample, outs, tile);
+				fastest = std::min(fastest, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+			if (fastest < best) {
+				best = fastest;
+				tile_ = tile;
+			}
+			if (tile >= sample) // большие плитки на этой выборке уже ничем не отличаются
+				break;
+		}
+		return tile_;
+	}
+	size_t tile() const { return tile_; }
+	void setTile(size_t tile) {
+		assert(tile > 0);
+		tile_ = tile;
+	}
+
+private:
+	void run(std::vector<double const*> const& columns, size_t n, std::vector<double*> const& outs, size_t tile) const {
+		assert(outs.size() == programs_.size());
+		std::vector<std::vector<double>> reduced; // свёртки от строк не зависят: один раз на вызов
+		for (Program const* program : programs_)
+			reduced.push_back(program->reduce());
+		Program::Scratch scratch; // общий для всех программ: буферы одной программы не вытесняют плитку
+		std::vector<double const*> shifted;
+		for (size_t base = 0; base < n; base += tile) {
+			size_t m = std::min(tile, n - base);
+			for (size_t p = 0; p < programs_.size(); ++p) {
+				shifted.resize(indices_[p].size());
+				for (size_t j = 0; j < shifted.size(); ++j)
+					shifted[j] = columns[indices_[p][j]] + base;
+				programs_[p]->run(shifted, m, outs[p] + base, programs_[p]->constants.data(), reduced[p].data(), scratch);
+			}
+		}
+	}
+
+	std::vector<Program const*> const programs_;
+	std::vector<std::vector<size_t>> indices_; // номер столбца для каждой переменной каждой программы
+	size_t tile_;
+};
+
+
+// Линейный распределитель: объекты не удаляются по одному, память освобождается вся сразу.
+// Деструкторы вызываются только у объектов, записанных через defer (make делает это для узлов, которые держат
+// память вне себя), поэтому откат арены узлов без такой памяти стоит O(1) независимо от их числа.
+struct Arena {
+public:
+	enum { CHUNK = 1 << 16 };
+
+	struct Finalizer { // запись о деструкторе; лежит в самой арене
+		Finalizer* previous;
+		void* object; // пусто после cancel
+		void (*destroy)(void*);
+	};
+
+	struct Mark { // положение указателя выделения; откат к нему освобождает всё выделенное позже
+		size_t chunk;
+		size_t used;
+		size_t bytes;
+		Finalizer* finalizers;
+	};
+
+	Arena() : current_(0), used_(0), bytes_(0), finalizers_(nullptr) {}
+	~Arena() {
+		reset();
+		for (char* chunk : chunks_)
+			delete[] chunk;
+	}
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+
+	void* allocate(size_t size, size_t align) {
+		size_t offset = (used_ + align - 1) & ~(align - 1);
+		if (chunks_.empty() || offset + size > sizes_[current_]) { // текущий кусок закончился
+			size_t next = chunks_.empty() ? 0 : current_ + 1;
+			if (next == chunks_.size() || sizes_[next] < size) { // после отката куски переиспользуются по порядку
+				size_t bytes = std::max<size_t>(CHUNK, size);
+				chunks_.insert(chunks_.begin() + next, new char[bytes]);
+				sizes_.insert(sizes_.begin() + next, bytes);
+				std::pair<char const*, size_t> range(chunks_[next], bytes);
+				ranges_.insert(std::upper_bound(ranges_.begin(), ranges_.end(), range, before), range);
+				Metrics::instance().count(Metrics::ALLOCATIONS);
+			}
+			current_ = next;
+			offset = 0;
+		}
+		used_ = offset + size;
+		bytes_ += size;
+		return chunks_[current_] + offset;
+	}
+	// Деревья из арены нельзя удалять через delete: деструкторы узлов удалили бы общие поддеревья.
+	// Деструктор объекта вызывается при откате арены за него, если у объекта есть что освобождать.
+	template <class T, class... Args>
+	T* make(Args&&... args) {
+		T* object = ::new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value && holds(object))
+			defer(object, [](void* p) { static_cast<T*>(p)->~T(); });
+		return object;
+	}
+	// destroy(object) будет вызван при откате за текущее положение или в деструкторе арены; записи идут в обратном порядке.
+	Finalizer* defer(void* object, void (*destroy)(void*)) {
+		finalizers_ = ::new (allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer{ finalizers_, object, destroy };
+		return finalizers_;
+	}
+	static void cancel(Finalizer* finalizer) { finalizer->object = nullptr; } // объект уже разрушен иначе
+	// Арена, деструкторы объектов которой вызываются сейчас в этом потоке. Узлы не удаляют потомков из неё:
+	// это общие поддеревья либо узлы со своей записью (см. Expression::dispose).
+	static Arena const*& finalizing() {
+		thread_local Arena const* arena = nullptr;
+		return arena;
+	}
+	size_t bytes() const { return bytes_; }
+	size_t capacity() const { // память, занятая кусками
+		size_t total = 0;
+		for (size_t size : sizes_)
+			total += size;
+		return total;
+	}
+	bool owns(void const* p) const { // лежит ли p в одном из кусков; сначала кусок прошлого попадания, затем двоичный поиск
+		char const* c = static_cast<char const*>(p);
+		if (hint_ < ranges_.size() && inside(c, ranges_[hint_]))
+			return true;
+		std::pair<char const*, size_t> key(c, 0);
+		auto it = std::upper_bound(ranges_.begin(), ranges_.end(), key, before);
+		if (it == ranges_.begin() || !inside(c, *(it - 1)))
+			return false;
+		hint_ = size_t(it - 1 - ranges_.begin());
+		return true;
+	}
+	Mark mark() const { return Mark{ current_, used_, bytes_, finalizers_ }; }
+	void rewind(Mark const& mark) { // деструкторы записанных после mark объектов, остальное O(1): куски остаются за ареной
+		Arena const* outer = finalizing();
+		finalizing() = this;
+		while (finalizers_ != mark.finalizers) {
+			Finalizer* finalizer = finalizers_;
+			finalizers_ = finalizer->previous;
+			if (finalizer->object)
+				finalizer->destroy(finalizer->object);
+		}
+		finalizing() = outer;
+		current_ = mark.chunk;
+		used_ = mark.used;
+		bytes_ = mark.bytes;
+	}
+	void reset() { rewind(Mark{ 0, 0, 0, nullptr }); }
+
+private:
+	static bool holds(Expression const* node) { return node->holds(); }
+	static bool holds(void const*) { return true; }
+	static bool before(std::pair<char const*, size_t> const& a, std::pair<char const*, size_t> const& b) {
+		return std::less<char const*>()(a.first, b.first);
+	}
+	static bool inside(char const* c, std::pair<char const*, size_t> const& range) {
+		return !std::less<char const*>()(c, range.first) && std::less<char const*>()(c, range.first + range.second);
+	}
+
+	std::vector<char*> chunks_;
+	std::vector<size_t> sizes_;
+	std::vector<std::pair<char const*, size_t>> ranges_; // начала и размеры кусков по возрастанию адреса, для owns
+	mutable size_t hint_ = 0; // номер в ranges_ последнего куска, где owns нашёл адрес
+	size_t current_;
+	size_t used_;
+	size_t bytes_;
+	Finalizer* finalizers_; // последняя запись defer
+};
+
+
+// Область запроса: пока объект жив, узлы Expression, созданные в этом потоке через new — в том числе
+// деревья CopySyntaxTree, FoldConstants и Differentiate, — берутся из арены потока. Конец области откатывает
+// арену к её началу, и куски памяти достаются следующему запросу. Деструкторы вызываются только у узлов,
+// записанных конструктором (Expression::track): у тех, что держат память в куче или потомка из кучи; их
+// обычно единицы, поэтому закрытие области не зависит от числа узлов. Области вкладываются. Деревья области
+// нельзя использовать после её конца; delete для их узлов вызывает деструктор, а память возвращается откатом.
+// Узлы вне областей берутся из кучи как обычно, без заголовка.
+struct RequestScope {
+public:
+	enum { HEADER = alignof(std::max_align_t) }; // место под Header, выравнивание узла сохраняется
+
+	RequestScope() : mark_(arena().mark()) { ++depth(); }
+	~RequestScope() {
+		--depth();
+		arena().rewind(mark_); // потомков из арены узлы не удаляют (см. Expression::dispose)
+	}
+	RequestScope(RequestScope const&) = delete;
+	RequestScope& operator=(RequestScope const&) = delete;
+
+	// Пока объект жив, узлы снова берутся из кучи: для деревьев, которые должны пережить область
+	// (например, тела функций реестра). Узлы области в это время удалять нельзя.
+	struct Outside {
+		Outside() : depth_(depth()) { depth() = 0; }
+		~Outside() { depth() = depth_; }
+		Outside(Outside const&) = delete;
+		Outside& operator=(Outside const&) = delete;
+
+	private:
+		int const depth_;
+	};
+
+	static bool active() { return depth() > 0; }
+	static Arena& arena() {
+		thread_local Arena arena;
+		return arena;
+	}
+	static void* allocate(size_t size) { // узел области с пустым заголовком
+		char* p = static_cast<char*>(arena().allocate(size + HEADER, HEADER));
+		::new (p) Header{ nullptr };
+		return p + HEADER;
+	}
+	static void track(Expression* node) { // деструктор узла будет вызван при закрытии области
+		header(node)->finalizer = arena().defer(node, [](void* p) { static_cast<Expression*>(p)->~Expression(); });
+	}
+	static bool release(void* p) { // true для узла открытой области этого потока: его память вернёт откат
+		if (!active() || !arena().owns(p))
+			return false;
+		if (header(p)->finalizer) // деструктор уже вызван через delete
+			Arena::cancel(header(p)->finalizer);
+		return true;
+	}
+
+private:
+	struct Header {
+		Arena::Finalizer* finalizer; // запись track или пусто
+	};
+	static_assert(sizeof(Header) <= HEADER, "заголовок должен помещаться перед узлом");
+
+	static Header* header(void* node) { return reinterpret_cast<Header*>(static_cast<char*>(node) - HEADER); }
+	static int& depth() {
+		thread_local int depth = 0;
+		return depth;
+	}
+
+	Arena::Mark const mark_;
+};
+
+
+inline void* Expression::operator new(size_t size) {
+	return RequestScope::active() ? RequestScope::allocate(size) : ::operator new(size);
+}
+
+
+inline void Expression::operator delete(void* p) {
+	if (p && !RequestScope::release(p)) // узлы из арены освобождаются откатом области
+		::operator delete(p);
+}
+
+
+inline void Expression::dispose(Expression const* child) {
+	Arena const* arena = Arena::finalizing();
+	if (child && !(arena && arena->owns(child)))
+		delete child;
+}
+
+
+inline void Expression::track(bool children) const {
+	if (RequestScope::active() && RequestScope::arena().owns(this) && (children || holds()))
+		RequestScope::track(const_cast<Expression*>(this));
+}
+
+
+inline bool Expression::outside(Expression const* child) {
+	return RequestScope::active() && !RequestScope::arena().owns(child);
+}
+
+
+inline bool FunctionRegistry::define(std::string const& name, std::vector<std::string> const& params, Expression const* body) {
+	if (!body || params.empty() || builtin(name) || reserved(name) || find(name))
+		return false;
+	for (size_t i = 0; i < params.size(); ++i)
+		if (params[i].empty() || std::find(params.begin(), params.begin() + i, params[i]) != params.begin() + i)
+			return false;
+	std::vector<std::string> scope(params);
+	size_t cost = 0;
+	if (!check(body, scope, cost))
+		return false;
+	if (RequestScope::active() && RequestScope::arena().owns(body)) { // реестр переживёт область: тело копируется в кучу
+		RequestScope::Outside heap;
+		CopySyntaxTree copy;
+		std::unique_ptr<Expression const> copied(body->transform(&copy));
+		if (!publish(name, std::unique_ptr<Definition>(new Definition{ params, copied.get(), cost, nullptr, nullptr })))
+			return false;
+		copied.release();
+		return true;
+	}
+	return publish(name, std::unique_ptr<Definition>(new Definition{ params, body, cost, nullptr, nullptr }));
+}
+
+
+struct Random { // splitmix64: одинаковая последовательность на любой платформе
+public:
+	Random(uint64_t seed) : state_(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+	double uniform() { return double(next() >> 11) * 0x1p-53; } // из [0, 1)
+	size_t below(size_t n) { return size_t(uniform() * double(n)); }
+
+private:
+	uint64_t state_;
+};
+
+
+// Популяция для символьной регрессии. Все деревья лежат в одной арене и неизменяемы,
+// поэтому скрещивание и мутация копируют только путь от корня до заменяемого узла, а остальные поддеревья разделяют.
+// Длинные имена переменных и свёртки освобождаются вместе с ареной (см. Arena::make).
+struct Population {
+public:
+	Population(std::vector<std::string> const& variables, uint64_t seed) : variables_(variables), random_(seed) {}
+
+	std::vector<Expression const*> individuals;
+
+	Expression const* randomTree(int depth, bool full) { // методы full и grow
+		if (depth <= 0 || (!full && random_.uniform() < 0.3)) {
+			if (variables_.empty() || random_.uniform() < 0.4)
+				return arena_.make<Number>(std::floor(random_.uniform() * 200.0 - 100.0) / 10.0);
+			return arena_.make<Variable>(variables_[random_.below(variables_.size())]);
+		}
+		if (random_.uniform() < 0.15)
+			return arena_.make<FunctionCall>(random_.uniform() < 0.5 ? "sqrt" : "abs", randomTree(depth - 1, full));
+		static int const ops[4] = { BinaryOperation::PLUS, BinaryOperation::MINUS, BinaryOperation::MUL, BinaryOperation::DIV };
+		Expression const* left = randomTree(depth - 1, full);
+		return arena_.make<BinaryOperation>(left, ops[random_.below(4)], randomTree(depth - 1, full));
+	}
+	void initialize(size_t size, int depth) { // «половина на половину» по глубинам 2..depth
+		individuals.clear();
+		for (size_t i = 0; i < size; ++i)
+			individuals.push_back(randomTree(2 + int(i % std::max(1, depth - 1)), i % 2 == 0));
+	}
+	Expression const* crossover(Expression const* a, Expression const* b) { // случайное поддерево a заменяется случайным поддеревом b
+		Expression const* donor = nodeAt(b, random_.below(size(b)));
+		return replace(a, random_.below(size(a)), donor);
+	}
+	Expression const* mutate(Expression const* a, int depth) {
+		return replace(a, random_.below(size(a)), randomTree(depth, false));
+	}
+	Arena const& arena() const { return arena_; }
+
+	static size_t size(Expression const* expr) { // число узлов
+		if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr))
+			return 1 + size(binop->left()) + size(binop->right());
+		if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+			size_t total = 1;
+			for (size_t i = 0; i < fcall->arity(); ++i)
+				total += size(fcall->arg(i));
+			return total;
+		}
+		if (Let const* let = dynamic_cast<Let const*>(expr))
+			return 1 + size(let->value()) + size(let->body());
+		if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr))
+			return 1 + size(reduction->arg()) + (reduction->right() ? size(reduction->right()) : 0);
+		return 1;
+	}
+	static Expression const* nodeAt(Expression const* expr, size_t index) { // узел с номером index в прямом обходе
+		if (index == 0)
+			return expr;
+		if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			size_t left = size(binop->left());
+			return index <= left ? nodeAt(binop->left(), index - 1) : nodeAt(binop->right(), index - 1 - left);
+		}
+		if (Let const* let = dynamic_cast<Let const*>(expr)) {
+			size_t value = size(let->value());
+			return index <= value ? nodeAt(let->value(), index - 1) : nodeAt(let->body(), index - 1 - value);
+		}
+		if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) {
+			size_t arg = size(reduction->arg());
+			return index <= arg ? nodeAt(reduction->arg(), index - 1) : nodeAt(reduction->right(), index - 1 - arg);
+		}
+		FunctionCall const* fcall = static_cast<FunctionCall const*>(expr);
+		for (size_t i = 0; i < fcall->arity(); ++i) { // аргументы идут подряд
+			size_t n = size(fcall->arg(i));
+			if (index <= n)
+				return nodeAt(fcall->arg(i), index - 1);
+			index -= n;
+		}
+		assert(false);
+		return expr;
+	}
+
+private:
+	Expression const* replace(Expression const* expr, size_t index, Expression const* with) {
+		if (index == 0)
+			return with;
+		if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			size_t left = size(binop->left());
+			if (index <= left)
+				return arena_.make<BinaryOperation>(replace(binop->left(), index - 1, with), binop->operation(), binop->right());
+			return arena_.make<BinaryOperation>(binop->left(), binop->operation(), replace(binop->right(), index - 1 - left, with));
+		}
+		if (Let const* let = dynamic_cast<Let const*>(expr)) {
+			size_t value = size(let->value());
+			if (index <= value)
+				return arena_.make<Let>(let->name(), replace(let->value(), index - 1, with), let->body());
+			return arena_.make<Let>(let->name(), let->value(), replace(let->body(), index - 1 - value, with));
+		}
+		if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) { // тело перекомпилируется в новом узле
+			size_t arg = size(reduction->arg());
+			if (!reduction->right())
+				return arena_.make<Reduction>(reduction->kind(), replace(reduction->arg(), index - 1, with));
+			if (index <= arg)
+				return arena_.make<Reduction>(reduction->kind(), replace(reduction->arg(), index - 1, with), reduction->right());
+			return arena_.make<Reduction>(reduction->kind(), reduction->arg(), replace(reduction->right(), index - 1 - arg, with));
+		}
+		FunctionCall const* fcall = static_cast<FunctionCall const*>(expr);
+		std::vector<Expression const*> args;
+		for (size_t i = 0; i < fcall->arity(); ++i)
+			args.push_back(fcall->arg(i));
+		for (Expression const*& arg : args) {
+			size_t n = size(arg);
+			if (index <= n) {
+				arg = replace(arg, index - 1, with);
+				break;
+			}
+			index -= n;
+		}
+		return arena_.make<FunctionCall>(fcall->name(), args);
+	}
+
+	std::vector<std::string> const variables_;
+	Random random_;
+	Arena arena_;
+};
+
+
+// Оценка приспособленности: среднеквадратичная ошибка на наборе данных.
+// Деревья распределяются по потокам, строки проходят блоками, и как только частичная сумма квадратов
+// превышает cutoff * n, особь признаётся заведомо плохой и получает бесконечную ошибку.
+struct FitnessEvaluator {
+public:
+	enum { ROWS = 4096 }; // строк между проверками раннего отсечения
+
+	FitnessEvaluator(std::vector<std::string> const& names, std::vector<double const*> const& columns, double const* target, size_t n)
+		: names_(names), columns_(columns), target_(target), n_(n) {
+		assert(names.size() == columns.size());
+	}
+
+	std::vector<double> evaluate(std::vector<Expression const*> const& trees, double cutoff, unsigned threads = 0) const {
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		std::vector<double> fitness(trees.size());
+		std::atomic<size_t> next(0);
+		double const limit = cutoff * double(n_);
+		std::vector<std::vector<double>> reduced(trees.size()); // свёртки читают Environment этого потока: считаются здесь
+		for (size_t t = 0; t < trees.size(); ++t)
+			for (Program::Reduced const& r : Compiler().operands(trees[t]).reductions)
+				reduced[t].push_back(Reduction::reduce(r.kind, *r.left, r.right.get()));
+		auto worker = [&]() {
+			std::vector<double> out(ROWS);
+			Compiler compiler;
+			Program::Scratch scratch;
+			for (size_t t; (t = next++) < trees.size(); ) {
+				Program program = compiler.compile(trees[t]);
+				std::vector<double const*> bound(program.variables.size());
+				for (size_t j = 0; j < bound.size(); ++j)
+					bound[j] = columns_[std::find(names_.begin(), names_.end(), program.variables[j]) - names_.begin()];
+				double sse = 0.0;
+				std::vector<double const*> shifted(bound.size());
+				for (size_t base = 0; base < n_ && sse <= limit; base += ROWS) {
+					size_t m = std::min<size_t>(ROWS, n_ - base);
+					for (size_t j = 0; j < bound.size(); ++j)
+						shifted[j] = bound[j] + base;
+					program.run(shifted, m, out.data(), program.constants.data(), reduced[t].data(), scratch);
+					for (size_t i = 0; i < m; ++i) {
+						double e = out[i] - target_[base + i];
+						sse += e * e;
+					}
+					if (sse != sse)
+						sse = std::numeric_limits<double>::infinity();
+				}
+				fitness[t] = sse <= limit ? sse / double(n_) : std::numeric_limits<double>::infinity();
+			}
+		};
+		std::vector<std::thread> pool;
+		for (unsigned i = 1; i < threads; ++i)
+			pool.emplace_back(worker);
+		worker();
+		for (std::thread& th : pool)
+			th.join();
+		return fitness;
+	}
+
+private:
+	std::vector<std::string> const names_;
+	std::vector<double const*> const columns_;
+	double const* target_;
+	size_t n_;
+};
+
+
+struct ShapeHash { // хеш формы дерева: значения чисел не учитываются, имена переменных и операции — учитываются
+public:
+	explicit ShapeHash(bool values = false) : values_(values) {} // values: учитывать и значения чисел (точный структурный хеш)
+
+	uint64_t hash(Expression const* expr) const {
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		mix(h, expr);
+		return h;
+	}
+
+private:
+	static void mix(uint64_t& h, uint64_t v) {
+		h ^= v;
+		h *= 1099511628211ull;
+	}
+	static void mix(uint64_t& h, std::string const& s) {
+		for (char c : s)
+			mix(h, uint64_t((unsigned char)c));
+		mix(h, uint64_t(s.size()));
+	}
+	void mix(uint64_t& h, Expression const* expr) const {
+		if (Number const* number = dynamic_cast<Number const*>(expr)) {
+			mix(h, uint64_t('n'));
+			if (values_) { // побитово: 0 и -0 дают разные результаты
+				uint64_t bits;
+				double value = number->value();
+				std::memcpy(&bits, &value, sizeof(bits));
+				mix(h, bits);
+			}
+		}
+		else if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			mix(h, uint64_t(binop->operation()));
+			mix(h, binop->left());
+			mix(h, binop->right());
+		}
+		else if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+			mix(h, uint64_t('f'));
+			mix(h, fcall->name());
+			for (size_t i = 0; i < fcall->arity(); ++i)
+				mix(h, fcall->arg(i));
+		}
+		else if (Variable const* var = dynamic_cast<Variable const*>(expr)) {
+			mix(h, uint64_t('v'));
+			mix(h, var->name());
+		}
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) {
+			mix(h, uint64_t('l'));
+			mix(h, let->name());
+			mix(h, let->value());
+			mix(h, let->body());
+		}
+		else if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) { // константы тела не параметризуются: ядра различает sameShape
+			mix(h, uint64_t('r'));
+			mix(h, uint64_t(reduction->kind()));
+			mix(h, reduction->arg());
+			if (reduction->right())
+				mix(h, reduction->right());
+		}
+	}
+
+	bool const values_;
+};
+
+
+struct KernelStats { // профиль одного ядра: имя — сокращённая запись первой скомпилированной в него формулы
+	enum { NAME_LENGTH = 64 };
+
+	KernelStats(Expression const* expr) : name(expr->print()), calls(0), rows(0), nanoseconds(0) {
+		if (name.size() > NAME_LENGTH)
+			name = name.substr(0, NAME_LENGTH - 3) + "...";
+	}
+
+	std::string name;
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> rows;
+	std::atomic<uint64_t> nanoseconds;
+};
+
+
+struct CompiledFormula { // общее ядро формы плюс собственные константы формулы
+	std::shared_ptr<Program const> kernel;
+	std::vector<double> params;
+	std::shared_ptr<KernelStats> stats; // пусто, если профилирование выключено
+
+	std::vector<std::string> const& variables() const { return kernel->variables; }
+	void run(std::vector<double const*> const& columns, size_t n, double* out) const {
+		Metrics& metrics = Metrics::instance();
+		if (!stats && !metrics.enabled) {
+			kernel->run(columns, n, out, params.data());
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		kernel->run(columns, n, out, params.data());
+		uint64_t elapsed = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		if (stats) {
+			stats->nanoseconds += elapsed;
+			stats->rows += n;
+			++stats->calls;
+		}
+		if (metrics.enabled) {
+			metrics.record(Metrics::BATCH, elapsed);
+			metrics.count(Metrics::DOMAIN_ERRORS, uint64_t(std::count_if(out, out + n, [](double v) { return v != v; })));
+		}
+	}
+};
+
+
+// Кэш компиляции с одной записью на форму: формулы, различающиеся только числами, получают общее ядро,
+// а их константы уходят в блок параметров.
+struct CompileCache {
+public:
+	CompileCache() : hits_(0), misses_(0), profiling_(false) {}
+
+	// Ядра, созданные после включения, получают профиль; выключение не трогает уже выданные формулы.
+	void setProfiling(bool enabled) { profiling_ = enabled; }
+
+	CompiledFormula compile(Expression const* expr) {
+		Metrics& metrics = Metrics::instance();
+		auto start = std::chrono::steady_clock::now();
+		CompiledFormula formula = lookup(expr);
+		if (metrics.enabled)
+			metrics.record(Metrics::COMPILE, uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+		return formula;
+	}
+	// Отчёт о горячих ядрах в духе perf report: доля времени, вызовы, строки, имя формулы.
+	void writeProfile(std::ostream& out) const {
+		std::vector<std::shared_ptr<KernelStats>> all;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (auto const& bucket : kernels_)
+				for (Entry const& entry : bucket.second)
+					if (entry.stats)
+						all.push_back(entry.stats);
+		}
+		std::sort(all.begin(), all.end(), [](std::shared_ptr<KernelStats> const& a, std::shared_ptr<KernelStats> const& b) {
+			return a->nanoseconds > b->nanoseconds;
+		});
+		uint64_t total = 0;
+		for (auto const& stats : all)
+			total += stats->nanoseconds;
+		for (auto const& stats : all)
+			out << 100.0 * double(stats->nanoseconds) / double(std::max<uint64_t>(total, 1)) << "%\t"
+				<< stats->calls << "\t" << stats->rows << "\t" << stats->name << std::endl;
+	}
+	size_t hits() const { return hits_; }
+	size_t misses() const { return misses_; }
+	size_t size() const { // число различных ядер
+		std::lock_guard<std::mutex> lock(mutex_);
+		size_t total = 0;
+		for (auto const& bucket : kernels_)
+			total += bucket.second.size();
+		return total;
+	}
+
+private:
+	struct Entry {
+		std::shared_ptr<Program const> kernel;
+		std::shared_ptr<KernelStats> stats;
+	};
+
+	// Сначала хеш и обход за константами; компиляция — только при промахе.
+	CompiledFormula lookup(Expression const* expr) {
+		Compiler compiler; // у компилятора есть состояние, поэтому свой на каждый вызов
+		Compiler::Operands operands = compiler.operands(expr);
+		CompiledFormula formula;
+		formula.params = operands.constants;
+		uint64_t key = ShapeHash().hash(expr);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto bucket = kernels_.find(key);
+			if (bucket != kernels_.end())
+				for (Entry const& entry : bucket->second)
+					if (matches(*entry.kernel, operands)) { // защита от коллизий хеша
+						++hits_;
+						Metrics::instance().count(Metrics::CACHE_HITS);
+						formula.kernel = entry.kernel;
+						formula.stats = entry.stats;
+						return formula;
+					}
+		}
+		Program program = compiler.compile(expr);
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<Entry>& bucket = kernels_[key];
+		for (Entry const& entry : bucket)
+			if (sameShape(*entry.kernel, program)) { // ту же форму успел скомпилировать другой поток
+				++hits_;
+				Metrics::instance().count(Metrics::CACHE_HITS);
+				formula.kernel = entry.kernel;
+				formula.stats = entry.stats;
+				return formula;
+			}
+		++misses_;
+		Metrics::instance().count(Metrics::COMPILES);
+		formula.kernel = std::make_shared<Program const>(program);
+		if (profiling_)
+			formula.stats = std::make_shared<KernelStats>(expr);
+		bucket.push_back(Entry{ formula.kernel, formula.stats });
+		return formula;
+	}
+
+	static bool matches(Program const& kernel, Compiler::Operands const& operands) { // всё, кроме значений констант
+		if (kernel.code.size() != operands.code.size() || kernel.variables != operands.variables
+			|| kernel.constants.size() != operands.constants.size() || kernel.functions != operands.functions
+			|| kernel.tables != operands.tables || kernel.reductions.size() != operands.reductions.size())
+			return false;
+		for (size_t i = 0; i < kernel.code.size(); ++i)
+			if (kernel.code[i].kind != operands.code[i].kind || kernel.code[i].arg != operands.code[i].arg)
+				return false;
+		for (size_t i = 0; i < kernel.reductions.size(); ++i)
+			if (kernel.reductions[i].left != operands.reductions[i].left || kernel.reductions[i].right != operands.reductions[i].right)
+				return false;
+		return true;
+	}
+	static bool sameShape(Program const& a, Program const& b) {
+		if (a.code.size() != b.code.size() || a.variables != b.variables)
+			return false;
+		for (size_t i = 0; i < a.code.size(); ++i)
+			if (a.code[i].kind != b.code[i].kind || a.code[i].arg != b.code[i].arg)
+				return false;
+		if (a.functions != b.functions || a.tables != b.tables || a.reductions.size() != b.reductions.size())
+			return false;
+		for (size_t i = 0; i < a.reductions.size(); ++i) // тела свёрток со своими константами: общее ядро только у той же свёртки
+			if (a.reductions[i].left != b.reductions[i].left || a.reductions[i].right != b.reductions[i].right)
+				return false;
+		return true;
+	}
+
+	std::unordered_map<uint64_t, std::vector<Entry>> kernels_;
+	mutable std::mutex mutex_;
+	std::atomic<size_t> hits_;
+	std::atomic<size_t> misses_;
+	std::atomic<bool> profiling_;
+};
+
+
+// Кэш результатов: ключ — точный структурный хеш формулы и значения её привязок.
+// Записи разложены по SHARDS независимым частям со своей блокировкой и своим списком LRU; запись также
+// истекает через ttl. При quantum > 0 значения в ключе округляются до кратных quantum, и близкие входы
+// получают результат, посчитанный для первого из них, — допуск выбирает вызывающий.
+// Массивы свёрток в ключ не входят: формулы со свёртками по меняющимся массивам кэшировать нельзя.
+struct ResultCache {
+public:
+	enum { SHARDS = 16 };
+	typedef std::vector<std::pair<std::string, double>> Bindings;
+
+	ResultCache(size_t capacity, std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::max(), double quantum = 0.0)
+		: perShard_(std::max<size_t>(1, capacity / SHARDS)), ttl_(ttl), quantum_(quantum), hits_(0), misses_(0), evictions_(0) {}
+
+	// Хеш формулы считается один раз на формулу, а не на запрос: он стоит столько же, сколько обход дерева.
+	static uint64_t fingerprint(Expression const* expr) { return ShapeHash(true).hash(expr); }
+
+	bool lookup(uint64_t formula, Bindings const& bindings, double& result) {
+		Bindings key = quantize(bindings);
+		uint64_t h = hash(formula, key);
+		Shard& shard = shards_[h % SHARDS];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.index.find(h);
+		if (it != shard.index.end() && it->second->formula == formula && same(it->second->key, key)) {
+			if (std::chrono::steady_clock::now() < it->second->expires) {
+				shard.entries.splice(shard.entries.begin(), shard.entries, it->second); // в голову LRU
+				result = it->second->result;
+				++hits_;
+				Metrics::instance().count(Metrics::RESULT_HITS);
+				return true;
+			}
+			shard.entries.erase(it->second);
+			shard.index.erase(it);
+			++evictions_;
+			Metrics::instance().count(Metrics::RESULT_EVICTIONS);
+		}
+		++misses_;
+		Metrics::instance().count(Metrics::RESULT_MISSES);
+		return false;
+	}
+	void store(uint64_t formula, Bindings const& bindings, double result) {
+		Bindings key = quantize(bindings);
+		uint64_t h = hash(formula, key);
+		auto now = std::chrono::steady_clock::now();
+		auto expires = ttl_ >= std::chrono::steady_clock::time_point::max() - now ? std::chrono::steady_clock::time_point::max() : now + ttl_;
+		Shard& shard = shards_[h % SHARDS];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.index.find(h);
+		if (it != shard.index.end()) { // тот же ключ или коллизия хеша: запись заменяется
+			shard.entries.erase(it->second);
+			shard.index.erase(it);
+		}
+		else if (shard.entries.size() >= perShard_) {
+			shard.index.erase(shard.entries.back().hash);
+			shard.entries.pop_back();
+			++evictions_;
+			Metrics::instance().count(Metrics::RESULT_EVICTIONS);
+		}
+		shard.entries.push_front(Entry{ h, formula, std::move(key), result, expires });
+		shard.index[h] = shard.entries.begin();
+	}
+	// Вычисление через кэш: привязки кладутся поверх Environment только при промахе.
+	double evaluate(Expression const* expr, uint64_t formula, Bindings const& bindings) {
+		double result;
+		if (lookup(formula, bindings, result))
+			return result;
+		std::vector<std::pair<std::string, double>>& environment = Environment::bindings();
+		size_t size = environment.size();
+		environment.insert(environment.end(), bindings.begin(), bindings.end());
+		result = expr->evaluate();
+		environment.resize(size);
+		store(formula, bindings, result);
+		return result;
+	}
+
+	size_t hits() const { return hits_; }
+	size_t misses() const { return misses_; }
+	size_t evictions() const { return evictions_; }
+	double hitRate() const { return double(hits_) / double(std::max<size_t>(1, hits_ + misses_)); }
+	size_t size() const {
+		size_t total = 0;
+		for (Shard const& shard : shards_) {
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			total += shard.entries.size();
+		}
+		return total;
+	}
+
+private:
+	struct Entry {
+		uint64_t hash;
+		uint64_t formula;
+		Bindings key; // привязки после округления
+		double result;
+		std::chrono::steady_clock::time_point expires;
+	};
+	struct Shard {
+		mutable std::mutex mutex;
+		std::list<Entry> entries; // от недавних к давним
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+	};
+
+	Bindings quantize(Bindings const& bindings) const {
+		Bindings key(bindings);
+		if (quantum_ > 0.0)
+			for (auto& binding : key)
+				binding.second = std::round(binding.second / quantum_) * quantum_;
+		return key;
+	}
+	static uint64_t hash(uint64_t formula, Bindings const& key) { // FNV-1a по хешу формулы, именам и битам значений
+		uint64_t h = 14695981039346656037ull;
+		auto mix = [&h](uint64_t v) {
+			h ^= v;
+			h *= 1099511628211ull;
+		};
+		mix(formula);
+		for (auto const& binding : key) {
+			for (char c : binding.first)
+				mix(uint64_t((unsigned char)c));
+			uint64_t bits;
+			std::memcpy(&bits, &binding.second, sizeof(bits));
+			mix(bits);
+		}
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull; // перемешивание splitmix64: у FNV младшие биты зависят
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebull; // только от младших битов входа, а по ним выбирается часть
+		return h ^ (h >> 31);
+	}
+	static bool same(Bindings const& a, Bindings const& b) { // побитово: NaN совпадает с таким же NaN
+		if (a.size() != b.size())
+			return false;
+		for (size_t i = 0; i < a.size(); ++i)
+			if (a[i].first != b[i].first || std::memcmp(&a[i].second, &b[i].second, sizeof(double)) != 0)
+				return false;
+		return true;
+	}
+
+	size_t const perShard_;
+	std::chrono::steady_clock::duration const ttl_;
+	double const quantum_;
+	Shard shards_[SHARDS];
+	std::atomic<size_t> hits_;
+	std::atomic<size_t> misses_;
+	std::atomic<size_t> evictions_;
+};
+
+
+// Именованная библиотека скомпилированных формул с заменой по принципу RCU.
+// Читатели не берут блокировок: они отмечают эпоху в своём слоте и читают текущий снимок.
+// Писатель собирает новый снимок в стороне, подменяет указатель атомарно и освобождает старые снимки,
+// когда все читатели, способные их видеть, вышли из чтения.
+struct FormulaLibrary {
+public:
+	typedef std::unordered_map<std::string, CompiledFormula> Snapshot;
+
+	FormulaLibrary() : id_(nextId()), current_(new Snapshot()), epoch_(1) {}
+	~FormulaLibrary() {
+		delete current_.load();
+		for (Retired const& retired : retired_)
+			delete retired.snapshot;
+	}
+	FormulaLibrary(FormulaLibrary const&) = delete;
+	FormulaLibrary& operator=(FormulaLibrary const&) = delete;
+
+private:
+	struct Slot { // слот читающего потока
+		std::atomic<uint64_t> epoch{ 0 }; // 0 — поток сейчас не читает
+		int depth = 0; // вложенные Reader одного потока; меняется только владельцем
+	};
+
+public:
+	struct Reader { // область чтения; снимок не освобождается, пока жив хотя бы один Reader, который мог его видеть
+	public:
+		Reader(FormulaLibrary const& library) : slot_(library.slot()) {
+			if (slot_->depth++ == 0)
+				slot_->epoch.store(library.epoch_.load());
+			snapshot_ = library.current_.load();
+		}
+		~Reader() {
+			if (--slot_->depth == 0)
+				slot_->epoch.store(0, std::memory_order_release);
+		}
+		Reader(Reader const&) = delete;
+		Reader& operator=(Reader const&) = delete;
+
+		CompiledFormula const* find(std::string const& name) const {
+			auto it = snapshot_->find(name);
+			return it == snapshot_->end() ? nullptr : &it->second;
+		}
+		Snapshot const& snapshot() const { return *snapshot_; }
+
+	private:
+		Slot* slot_;
+		Snapshot const* snapshot_;
+	};
+
+	// Полная замена библиотеки; снимок строится вызывающим потоком заранее.
+	void publish(Snapshot snapshot) {
+		std::lock_guard<std::mutex> lock(writer_);
+		swap(new Snapshot(std::move(snapshot)));
+	}
+	// Копирование текущего снимка с правкой edit, затем публикация.
+	template <class Edit>
+	void update(Edit edit) {
+		std::lock_guard<std::mutex> lock(writer_);
+		Snapshot* next = new Snapshot(*current_.load());
+		edit(*next);
+		swap(next);
+	}
+	size_t pending() const { // сколько старых снимков ждут освобождения
+		std::lock_guard<std::mutex> lock(writer_);
+		return retired_.size();
+	}
+	void reclaim() {
+		std::lock_guard<std::mutex> lock(writer_);
+		collect();
+	}
+
+private:
+	struct Retired {
+		Snapshot const* snapshot;
+		uint64_t epoch; // эпоха, в которой снимок перестал быть текущим
+	};
+
+	static uint64_t nextId() {
+		static std::atomic<uint64_t> id(0);
+		return ++id;
+	}
+	Slot* slot() const { // слот регистрируется один раз на поток; потом — поиск в локальном списке потока
+		thread_local std::vector<std::pair<uint64_t, std::shared_ptr<Slot>>> slots;
+		for (auto const& entry : slots)
+			if (entry.first == id_)
+				return entry.second.get();
+		std::shared_ptr<Slot> slot = std::make_shared<Slot>();
+		{
+			std::lock_guard<std::mutex> lock(readers_);
+			slots_.push_back(slot);
+		}
+		slots.emplace_back(id_, slot);
+		return slot.get();
+	}
+	void swap(Snapshot* next) {
+		Snapshot const* old = current_.exchange(next);
+		retired_.push_back(Retired{ old, epoch_.fetch_add(1) });
+		collect();
+	}
+	void collect() { // старый снимок виден только читателям, вошедшим не позже эпохи его замены
+		uint64_t oldest = std::numeric_limits<uint64_t>::max();
+		{
+			std::lock_guard<std::mutex> lock(readers_);
+			for (std::shared_ptr<Slot> const& slot : slots_) {
+				uint64_t epoch = slot->epoch.load();
+				if (epoch != 0)
+					oldest = std::min(oldest, epoch);
+			}
+		}
+		size_t kept = 0;
+		for (Retired const& retired : retired_)
+			if (retired.epoch < oldest)
+				delete retired.snapshot;
+			else
+				retired_[kept++] = retired;
+		retired_.resize(kept);
+	}
+
+	uint64_t const id_;
+	std::atomic<Snapshot const*> current_;
+	std::atomic<uint64_t> epoch_;
+	mutable std::mutex writer_;
+	mutable std::mutex readers_; // только регистрация новых читающих потоков и обход слотов писателем
+	mutable std::vector<std::shared_ptr<Slot>> slots_;
+	std::vector<Retired> retired_;
+};
+
+
+// Несколько формул одной формы с одними и теми же значениями переменных: константы упакованы по дорожкам (SoA),
+// и один проход по ядру вычисляет сразу LANES формул. Дополняет пакетное вычисление по строкам.
+struct FormulaPack {
+public:
+	enum { LANES = 8 };
+
+	FormulaPack(std::vector<CompiledFormula> const& formulas) : count_(formulas.size()) {
+		assert(!formulas.empty());
+		kernel_ = formulas[0].kernel;
+		size_t slots = kernel_->constants.size(), groups = (count_ + LANES - 1) / LANES;
+		params_.assign(groups * slots * LANES, 0.0); // [группа][константа][дорожка]
+		for (size_t k = 0; k < count_; ++k) {
+			assert(formulas[k].kernel == kernel_); // формулы должны разделять ядро
+			for (size_t c = 0; c < slots; ++c)
+				params_[((k / LANES) * slots + c) * LANES + k % LANES] = formulas[k].params[c];
+		}
+	}
+
+	size_t size() const { return count_; }
+	std::vector<std::string> const& variables() const { return kernel_->variables; }
+
+	// values[i] — значение variables()[i]; out[k] — результат k-й формулы.
+	void run(double const* values, double* out) const {
+		Program const& kernel = *kernel_;
+		size_t slots = kernel.constants.size();
+		std::vector<double> stack(size_t(kernel.stackDepth) * LANES), local(size_t(kernel.locals) * LANES);
+		std::vector<double> reduced = kernel.reduce();
+		Program::Scratch calls; // calls.calls[i] — буферы ядра functions[i] на все группы
+		calls.calls.resize(kernel.functions.size());
+		for (size_t group = 0; group * LANES < count_; ++group) {
+			double const* params = &params_[group * slots * LANES];
+			int top = 0;
+			for (Instruction const& ins : kernel.code) {
+				double* r = &stack[size_t(top) * LANES];
+				switch (ins.kind) {
+				case Instruction::CONST:
+					std::copy(params + ins.arg * LANES, params + (ins.arg + 1) * LANES, r);
+					++top;
+					break;
+				case Instruction::VAR:
+					std::fill(r, r + LANES, values[ins.arg]);
+					++top;
+					break;
+				case Instruction::BINOP: {
+					double* a = r - 2 * LANES;
+					double const* b = r - LANES;
+					switch (ins.arg) {
+					case BinaryOperation::PLUS: for (int i = 0; i < LANES; ++i) a[i] += b[i]; break;
+					case BinaryOperation::MINUS: for (int i = 0; i < LANES; ++i) a[i] -= b[i]; break;
+					case BinaryOperation::DIV: for (int i = 0; i < LANES; ++i) a[i] /= b[i]; break;
+					case BinaryOperation::MUL: for (int i = 0; i < LANES; ++i) a[i] *= b[i]; break;
+					}
+					--top;
+					break;
+				}
+				case Instruction::SQRT:
+					for (int i = 0; i < LANES; ++i) r[i - LANES] = std::sqrt(r[i - LANES]);
+					break;
+				case Instruction::ABS:
+					for (int i = 0; i < LANES; ++i) r[i - LANES] = std::fabs(r[i - LANES]);
+					break;
+				case Instruction::STORE:
+					std::copy(r - LANES, r, &local[size_t(ins.arg) * LANES]);
+					--top;
+					break;
+				case Instruction::LOAD:
+					std::copy(&local[size_t(ins.arg) * LANES], &local[size_t(ins.arg + 1) * LANES], r);
+					++top;
+					break;
+				case Instruction::CALL: { // дорожки пачки — строки пакетного вызова ядра функции
+					Program const& callee = *kernel.functions[ins.arg];
+					size_t arity = callee.variables.size();
+					calls.args.resize(arity);
+					for (size_t j = 0; j < arity; ++j)
+						calls.args[j] = r - (arity - j) * LANES;
+					callee.run(calls.args, LANES, r - arity * LANES, callee.constants.data(), nullptr, calls.calls[ins.arg]);
+					top += 1 - int(arity);
+					break;
+				}
+				case Instruction::REDUCE:
+					std::fill(r, r + LANES, reduced[ins.arg]);
+					++top;
+					break;
+				case Instruction::TABLE:
+					kernel.tables[ins.arg]->evaluate(r - LANES, LANES, r - LANES);
+					break;
+				}
+			}
+			size_t m = std::min<size_t>(LANES, count_ - group * LANES);
+			std::copy(stack.begin(), stack.begin() + m, out + group * LANES);
+		}
+	}
+
+private:
+	std::shared_ptr<Program const> kernel_;
+	size_t count_;
+	std::vector<double> params_;
+};
+
+
+// Постфиксная сериализация дерева: запись на узел — байт-тег (как у Instruction) и данные.
+// Формат позволяет вычислять выражение прямо из потока, не строя дерево.
+struct PostorderWriter {
+public:
+	enum { UNBIND = 'e' }; // конец области let; начало области — тег Instruction::STORE с именем
+
+	PostorderWriter(std::ostream& out) : out_(out) {}
+
+	void write(Expression const* expr) {
+		if (Number const* number = dynamic_cast<Number const*>(expr))
+			this->number(number->value());
+		else if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			write(binop->left());
+			write(binop->right());
+			binary(binop->operation());
+		}
+		else if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr)) {
+			for (size_t i = 0; i < fcall->arity(); ++i)
+				write(fcall->arg(i));
+			call(fcall->name());
+		}
+		else if (Variable const* var = dynamic_cast<Variable const*>(expr))
+			variable(var->name());
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) { // значение, привязка, тело, конец области
+			write(let->value());
+			bind(let->name());
+			write(let->body());
+			unbind();
+		}
+		else
+			assert(false); // свёртки в поток не пишутся: потоковый вычислитель не знает массивов
+	}
+	// Отдельные записи — для генераторов, которые пишут поток, не имея дерева в памяти.
+	void number(double value) {
+		out_.put(char(Instruction::CONST));
+		out_.write(reinterpret_cast<char const*>(&value), sizeof(value));
+	}
+	void variable(std::string const& name) {
+		assert(name.size() < 65536);
+		uint16_t length = uint16_t(name.size());
+		out_.put(char(Instruction::VAR));
+		out_.write(reinterpret_cast<char const*>(&length), sizeof(length));
+		out_.write(name.data(), length);
+	}
+	void binary(int op) {
+		out_.put(char(Instruction::BINOP));
+		out_.put(char(op));
+	}
+	void call(std::string const& name) { // пользовательская функция пишется с именем; её арность знает реестр
+		if (name == "sqrt" || name == "abs") {
+			out_.put(char(name == "sqrt" ? Instruction::SQRT : Instruction::ABS));
+			return;
+		}
+		assert(name.size() < 65536);
+		uint16_t length = uint16_t(name.size());
+		out_.put(char(Instruction::CALL));
+		out_.write(reinterpret_cast<char const*>(&length), sizeof(length));
+		out_.write(name.data(), length);
+	}
+	void bind(std::string const& name) { // вершина стека становится значением name до парного unbind
+		assert(name.size() < 65536);
+		uint16_t length = uint16_t(name.size());
+		out_.put(char(Instruction::STORE));
+		out_.write(reinterpret_cast<char const*>(&length), sizeof(length));
+		out_.write(name.data(), length);
+	}
+	void unbind() {
+		out_.put(char(UNBIND));
+	}
+
+private:
+	std::ostream& out_;
+};
+
+
+struct ByteSource { // откуда читается постфиксный поток
+	virtual ~ByteSource() {}
+	virtual bool read(void* to, size_t size) = 0; // false — поток кончился
+};
+
+
+struct StreamSource : ByteSource { // файл или любой другой std::istream
+public:
+	StreamSource(std::istream& in) : in_(in) {}
+	bool read(void* to, size_t size) { return bool(in_.read(static_cast<char*>(to), std::streamsize(size))); }
+
+private:
+	std::istream& in_;
+};
+
+
+struct MemorySource : ByteSource { // отображённый в память файл или буфер
+public:
+	MemorySource(char const* data, size_t size) : data_(data), size_(size), position_(0) {}
+	bool read(void* to, size_t size) {
+		if (size > size_ - position_)
+			return false;
+		std::memcpy(to, data_ + position_, size);
+		position_ += size;
+		return true;
+	}
+
+private:
+	char const* data_;
+	size_t size_;
+	size_t position_;
+};
+
+
+struct MappedFile { // файл, отображённый в память только для чтения
+public:
+	MappedFile(std::string const& path) : data_(nullptr), size_(0) {
+#ifdef __linux__
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				madvise(p, size_t(st.st_size), MADV_SEQUENTIAL); // поток читается один раз подряд
+				data_ = static_cast<char const*>(p);
+				size_ = size_t(st.st_size);
+			}
+		}
+		close(fd);
+#endif
+	}
+	~MappedFile() {
+#ifdef __linux__
+		if (data_)
+			munmap(const_cast<char*>(data_), size_);
+#endif
+	}
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	bool valid() const { return data_ != nullptr; }
+	char const* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	char const* data_;
+	size_t size_;
+};
+
+
+// Вычисление постфиксного потока без построения дерева: в памяти только стек операндов,
+// то есть глубина дерева (в пакетном режиме — глубина, умноженная на число строк).
+struct StreamEvaluator {
+public:
+	// columns — столбцы переменных по именам; переменная без столбца равна 0, как в Variable::evaluate.
+	// Возвращает false, если поток повреждён или закончился раньше выражения.
+	bool evaluate(ByteSource& source, std::unordered_map<std::string, double const*> const& columns, size_t n, double* out) {
+		size_t top = 0, scopes = 0;
+		std::string name;
+		for (char tag; source.read(&tag, 1); ) {
+			switch (tag) {
+			case Instruction::CONST: {
+				double value;
+				if (!source.read(&value, sizeof(value)))
+					return false;
+				std::fill_n(push(top, n), n, value);
+				break;
+			}
+			case Instruction::VAR: {
+				if (!readName(source, name))
+					return false;
+				double* r = push(top, n);
+				size_t scope = scopes;
+				while (scope > 0 && scopes_[scope - 1].first != name)
+					--scope;
+				if (scope > 0) { // имя связано let из потока
+					std::copy(scopes_[scope - 1].second.begin(), scopes_[scope - 1].second.begin() + n, r);
+					break;
+				}
+				auto column = columns.find(name);
+				if (column == columns.end())
+					std::fill_n(r, n, 0.0);
+				else
+					std::copy(column->second, column->second + n, r);
+				break;
+			}
+			case Instruction::BINOP: {
+				char op;
+				if (!source.read(&op, 1) || top < 2)
+					return false;
+				double* a = stack_[top - 2].data();
+				double const* b = stack_[top - 1].data();
+				switch (op) {
+				case BinaryOperation::PLUS: for (size_t i = 0; i < n; ++i) a[i] += b[i]; break;
+				case BinaryOperation::MINUS: for (size_t i = 0; i < n; ++i) a[i] -= b[i]; break;
+				case BinaryOperation::DIV: for (size_t i = 0; i < n; ++i) a[i] /= b[i]; break;
+				case BinaryOperation::MUL: for (size_t i = 0; i < n; ++i) a[i] *= b[i]; break;
+				default: return false;
+				}
+				--top;
+				break;
+			}
+			case Instruction::SQRT:
+			case Instruction::ABS: {
+				if (top < 1)
+					return false;
+				double* a = stack_[top - 1].data();
+				for (size_t i = 0; i < n; ++i)
+					a[i] = tag == Instruction::SQRT ? std::sqrt(a[i]) : std::fabs(a[i]);
+				break;
+			}
+			case Instruction::CALL: { // аргументы на вершине стека; ядро функции пишет результат на место первого
+				if (!readName(source, name))
+					return false;
+				FunctionRegistry::Definition const* definition = FunctionRegistry::instance().find(name);
+				if (!definition || top < definition->params.size())
+					return false;
+				std::shared_ptr<Program const> kernel = Compiler().kernel(definition);
+				size_t arity = definition->params.size();
+				args_.resize(arity);
+				for (size_t j = 0; j < arity; ++j)
+					args_[j] = stack_[top - arity + j].data();
+				// Блок результата пишется после чтения того же блока входов; свёрток в ядрах функций нет.
+				kernel->run(args_, n, stack_[top - arity].data(), kernel->constants.data(), nullptr, call_);
+				top -= arity - 1;
+				break;
+			}
+			case Instruction::STORE: // значение let уходит со стека в область видимости без копирования
+				if (!readName(source, name) || top < 1)
+					return false;
+				if (scopes == scopes_.size())
+					scopes_.emplace_back();
+				scopes_[scopes].first = name;
+				std::swap(scopes_[scopes++].second, stack_[--top]);
+				break;
+			case PostorderWriter::UNBIND:
+				if (scopes == 0)
+					return false;
+				--scopes;
+				break;
+			default:
+				return false;
+			}
+		}
+		if (top != 1 || scopes != 0)
+			return false;
+		std::copy(stack_[0].begin(), stack_[0].begin() + n, out);
+		return true;
+	}
+	size_t maxDepth() const { return stack_.size(); } // наибольшая глубина стека за время жизни
+
+private:
+	static bool readName(ByteSource& source, std::string& name) {
+		uint16_t length;
+		if (!source.read(&length, sizeof(length)))
+			return false;
+		name.resize(length);
+		return length == 0 || source.read(&name[0], length);
+	}
+	double* push(size_t& top, size_t n) { // буферы стека переиспользуются между вызовами
+		if (top == stack_.size())
+			stack_.emplace_back();
+		stack_[top].resize(n);
+		return stack_[top++].data();
+	}
+
+	std::vector<std::vector<double>> stack_;
+	std::vector<std::pair<std::string, std::vector<double>>> scopes_; // значения let, от внешних к внутренним
+	std::vector<double const*> args_;
+	Program::Scratch call_; // буферы ядер вызываемых функций, общие для всех вызовов
+};
+
+
+// Статистический профиль корпуса формул: по нему генератор воспроизводит похожие формулы.
+struct CorpusProfile {
+	enum { PLUS, MINUS, MUL, DIV, SQRT, ABS, KINDS }; // виды внутренних узлов
+	enum { POOL_SIZES = 13 }; // повторяемые поддеревья имеют от 3 до POOL_SIZES + 2 узлов
+
+	CorpusProfile() : sizes(1, 31), variableShare(0.5), variables(4), chain(0.2), sharing(0.0) {
+		std::fill(weights, weights + KINDS, 1.0);
+		weights[SQRT] = weights[ABS] = 0.25;
+	}
+
+	std::vector<size_t> sizes; // выборка размеров формул в узлах; размер очередной формулы берётся из неё
+	double weights[KINDS]; // относительные частоты операций в узлах от трёх узлов; узел из двух — всегда sqrt или abs над листом
+	double variableShare; // доля переменных среди листьев
+	int variables; // число различных переменных x0, x1, ...
+	double chain; // доля бинарных узлов (от пяти узлов), у которых один потомок — лист; задаёт профиль глубины
+	double sharing; // доля поддеревьев размера 3..POOL_SIZES+2, повторяющих уже встречавшиеся
+
+	static CorpusProfile measure(std::vector<Expression const*> const& corpus) {
+		CorpusProfile profile;
+		profile.sizes.clear();
+		std::fill(profile.weights, profile.weights + KINDS, 0.0);
+		Counts counts;
+		for (Expression const* expr : corpus)
+			profile.sizes.push_back(count(expr, counts, profile));
+		if (profile.sizes.empty())
+			return CorpusProfile();
+		profile.variableShare = counts.leaves ? double(counts.variableLeaves) / double(counts.leaves) : 0.0;
+		profile.variables = std::max<int>(1, int(counts.names.size()));
+		profile.chain = counts.binary ? double(counts.chained) / double(counts.binary) : 0.0;
+		profile.sharing = counts.subtrees ? double(counts.repeated) / double(counts.subtrees) : 0.0;
+		return profile;
+	}
+
+private:
+	struct Counts {
+		size_t leaves = 0, variableLeaves = 0, binary = 0, chained = 0, subtrees = 0, repeated = 0;
+		std::vector<std::string> names;
+		std::unordered_map<uint64_t, int> seen; // хеши поддеревьев с учётом значений
+	};
+
+	static size_t count(Expression const* expr, Counts& counts, CorpusProfile& profile) { // возвращает размер, копит статистику
+		uint64_t hash;
+		return count(expr, counts, profile, hash);
+	}
+	static size_t count(Expression const* expr, Counts& counts, CorpusProfile& profile, uint64_t& hash) {
+		size_t size = 1;
+		if (Number const* number = dynamic_cast<Number const*>(expr)) {
+			++counts.leaves;
+			double value = number->value();
+			std::memcpy(&hash, &value, sizeof(hash));
+			return 1;
+		}
+		if (Variable const* var = dynamic_cast<Variable const*>(expr)) {
+			++counts.leaves;
+			++counts.variableLeaves;
+			if (std::find(counts.names.begin(), counts.names.end(), var->name()) == counts.names.end())
+				counts.names.push_back(var->name());
+			hash = std::hash<std::string>()(var->name());
+			return 1;
+		}
+		uint64_t left = 0, right = 0;
+		size_t subtrees = counts.subtrees, repeated = counts.repeated;
+		if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr)) {
+			size_t a = count(binop->left(), counts, profile, left);
+			size_t b = count(binop->right(), counts, profile, right);
+			int op = binop->operation();
+			profile.weights[op == BinaryOperation::PLUS ? PLUS : op == BinaryOperation::MINUS ? MINUS : op == BinaryOperation::MUL ? MUL : DIV] += 1.0;
+			if (a + b >= 4) { // в меньших узлах лист среди потомков неизбежен
+				++counts.binary;
+				counts.chained += (a == 1 || b == 1) ? 1 : 0;
+			}
+			size += a + b;
+			hash = uint64_t(op);
+		}
+		else if (Let const* let = dynamic_cast<Let const*>(expr)) { // явное разделение: операций не добавляет
+			size += count(let->value(), counts, profile, left);
+			size += count(let->body(), counts, profile, right);
+			hash = 'l' ^ std::hash<std::string>()(let->name());
+		}
+		else if (Reduction const* reduction = dynamic_cast<Reduction const*>(expr)) { // генератор свёрток не порождает
+			size += count(reduction->arg(), counts, profile, left);
+			if (reduction->right())
+				size += count(reduction->right(), counts, profile, right);
+			hash = uint64_t(reduction->kind());
+		}
+		else {
+			FunctionCall const* fcall = static_cast<FunctionCall const*>(expr);
+			size += count(fcall->arg(), counts, profile, left);
+			for (size_t i = 1; i < fcall->arity(); ++i) { // остальные аргументы сворачиваются в правый хеш
+				uint64_t arg = 0;
+				size += count(fcall->arg(i), counts, profile, arg);
+				right = right * 1099511628211ull ^ arg;
+			}
+			if (!fcall->definition() && size >= 3) // пользовательские функции генератор не порождает, а узел из двух не выбирает
+				profile.weights[fcall->name() == "sqrt" ? SQRT : ABS] += 1.0;
+			hash = fcall->definition() ? std::hash<std::string>()(fcall->name()) : fcall->name() == "sqrt" ? 's' : 'a';
+		}
+		hash = ((hash * 1099511628211ull) ^ left) * 1099511628211ull ^ right;
+		if (size >= 3 && size < POOL_SIZES + 3) {
+			if (counts.seen[hash]++) { // повтор считается один раз, без вложенных в него поддеревьев
+				counts.subtrees = subtrees;
+				counts.repeated = repeated + 1;
+			}
+			++counts.subtrees;
+		}
+		return size;
+	}
+};
+
+
+// Детерминированный генератор корпуса: одинаковые профиль и seed дают одинаковый поток.
+// Формулы строятся по одной во временной арене и сразу пишутся, так что объём вывода не ограничен памятью.
+struct CorpusGenerator {
+public:
+	enum { POOL = 20, POOL_REFRESH = 4096 }; // поддеревьев каждого размера в общем пуле и как часто он обновляется
+
+	CorpusGenerator(CorpusProfile const& profile, uint64_t seed) : profile_(profile), random_(seed), generated_(0) {
+		for (int i = 0; i < profile.variables; ++i)
+			names_.push_back("x" + std::to_string(i));
+		double total = 0.0;
+		for (int k = 0; k < CorpusProfile::KINDS; ++k)
+			total += profile.weights[k];
+		for (int k = 0; k < CorpusProfile::KINDS; ++k)
+			cumulative_[k] = (k ? cumulative_[k - 1] : 0.0) + (total > 0.0 ? profile.weights[k] / total : 0.0);
+	}
+
+	// Текст: одна формула на строку, как её печатает print().
+	void writeText(std::ostream& out, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			Arena arena;
+			out << next(arena)->print() << '\n';
+		}
+	}
+	// Двоичный вид: каждая формула — длина в байтах (uint64) и её постфиксный поток для StreamEvaluator.
+	void writeBinary(std::ostream& out, size_t count) {
+		std::ostringstream buffer;
+		for (size_t i = 0; i < count; ++i) {
+			Arena arena;
+			buffer.str(std::string());
+			PostorderWriter(buffer).write(next(arena));
+			std::string const bytes = buffer.str();
+			uint64_t length = bytes.size();
+			out.write(reinterpret_cast<char const*>(&length), sizeof(length));
+			out.write(bytes.data(), std::streamsize(bytes.size()));
+		}
+	}
+	Expression const* next(Arena& arena) { // очередная формула корпуса в заданной арене
+		if (generated_++ % POOL_REFRESH == 0)
+			refreshPool();
+		return grow(arena, profile_.sizes[random_.below(profile_.sizes.size())], true);
+	}
+
+private:
+	void refreshPool() {
+		pool_arena_.reset(new Arena());
+		for (int s = 0; s < CorpusProfile::POOL_SIZES; ++s) {
+			pool_[s].clear();
+			for (int i = 0; profile_.sharing > 0.0 && i < POOL; ++i)
+				pool_[s].push_back(grow(*pool_arena_, s + 3, false));
+		}
+	}
+	Expression const* leaf(Arena& arena) {
+		if (random_.uniform() < profile_.variableShare)
+			return arena.make<Variable>(names_[random_.below(names_.size())]);
+		return arena.make<Number>(std::floor(random_.uniform() * 2000.0 - 1000.0) / 100.0);
+	}
+	Expression const* grow(Arena& arena, size_t size, bool share) {
+		if (size <= 1)
+			return leaf(arena);
+		if (share && size >= 3 && size < CorpusProfile::POOL_SIZES + 3 && random_.uniform() < profile_.sharing) {
+			std::vector<Expression const*> const& pool = pool_[size - 3];
+			return pool[random_.below(pool.size())]; // повтор: поддерево того же размера из общего пула
+		}
+		int kind = 0;
+		for (double u = random_.uniform(); kind < CorpusProfile::KINDS - 1 && u >= cumulative_[kind]; )
+			++kind;
+		bool unary = kind == CorpusProfile::SQRT || kind == CorpusProfile::ABS;
+		if (size == 2 && !unary) { // бинарному узлу нужно хотя бы три узла: два узла — это унарный над листом
+			double sqrts = profile_.weights[CorpusProfile::SQRT], abses = profile_.weights[CorpusProfile::ABS];
+			kind = random_.uniform() * (sqrts + abses) < abses ? CorpusProfile::ABS : CorpusProfile::SQRT;
+			unary = true;
+		}
+		if (unary)
+			return arena.make<FunctionCall>(kind == CorpusProfile::ABS ? "abs" : "sqrt", grow(arena, size - 1, share));
+		static int const ops[4] = { BinaryOperation::PLUS, BinaryOperation::MINUS, BinaryOperation::MUL, BinaryOperation::DIV };
+		size_t rest = size - 1, left;
+		if (rest < 4 || random_.uniform() < profile_.chain) // то же определение цепочки, что в CorpusProfile::count
+			left = random_.uniform() < 0.5 ? 1 : rest - 1; // цепочка: один из потомков — лист
+		else
+			left = 2 + random_.below(rest - 3);
+		Expression const* l = grow(arena, left, share);
+		return arena.make<BinaryOperation>(l, ops[kind], grow(arena, rest - left, share));
+	}
+
+	CorpusProfile const profile_;
+	Random random_;
+	size_t generated_;
+	std::vector<std::string> names_;
+	double cumulative_[CorpusProfile::KINDS];
+	std::unique_ptr<Arena> pool_arena_;
+	std::vector<Expression const*> pool_[CorpusProfile::POOL_SIZES];
+};
+
+
+// Аппаратные счётчики через perf_event_open. Если счётчик недоступен (нет прав, виртуальная машина, не Linux),
+// он просто не открывается, и отчёт ограничивается временем.
+struct PerfCounters {
+public:
+	enum {
+		CYCLES,
+		INSTRUCTIONS,
+		L1_MISSES, // промахи L1 данных на чтение
+		LLC_MISSES, // промахи последнего уровня кэша
+		BRANCH_MISSES,
+		COUNT
+	};
+
+	PerfCounters() {
+		std::fill(fds_, fds_ + COUNT, -1);
+		std::fill(values_, values_ + COUNT, uint64_t(0));
+#ifdef __linux__
+		uint64_t const cache = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+		open(CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+		open(INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		open(L1_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache);
+		open(LLC_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cache);
+		open(BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+	}
+	~PerfCounters() {
+#ifdef __linux__
+		for (int fd : fds_)
+			if (fd >= 0)
+				close(fd);
+#endif
+	}
+	PerfCounters(PerfCounters const&) = delete;
+	PerfCounters& operator=(PerfCounters const&) = delete;
+
+	static char const* name(int counter) {
+		static char const* const names[COUNT] = { "cycles", "instructions", "L1-misses", "LLC-misses", "branch-misses" };
+		return names[counter];
+	}
+	bool available(int counter) const { return fds_[counter] >= 0; }
+	uint64_t value(int counter) const { return values_[counter]; }
+
+	void start() {
+#ifdef __linux__
+		for (int fd : fds_)
+			if (fd >= 0) {
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+	}
+	void stop() {
+#ifdef __linux__
+		for (int i = 0; i < COUNT; ++i)
+			if (fds_[i] >= 0) {
+				ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+				if (read(fds_[i], &values_[i], sizeof(values_[i])) != sizeof(values_[i]))
+					values_[i] = 0;
+			}
+#endif
+	}
+
+private:
+#ifdef __linux__
+	void open(int counter, uint32_t type, uint64_t config) {
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fds_[counter] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+#endif
+
+	int fds_[COUNT];
+	uint64_t values_[COUNT];
+};
+
+
+// Запускает body repeat раз под счётчиками и печатает строку отчёта с величинами на один узел.
+template <class Body>
+void benchmarkCase(PerfCounters& counters, char const* name, size_t nodes, int repeat, Body body) {
+	counters.start();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeat; ++i)
+		body();
+	auto finish = std::chrono::steady_clock::now();
+	counters.stop();
+	double perNode = double(nodes) * repeat;
+	std::cout << name << ": " << std::chrono::duration<double, std::nano>(finish - start).count() / perNode << " ns/node";
+	for (int c = 0; c < PerfCounters::COUNT; ++c)
+		if (counters.available(c))
+			std::cout << ", " << double(counters.value(c)) / perNode << " " << PerfCounters::name(c) << "/node";
+	std::cout << std::endl;
+}
+
+
+// Сравнение double-double с обычным вычислением по точности и скорости.
+// f(x, y) = (x + y) - x при x = 1e17 и целых y: точный ответ равен y.
+void benchmarkDoubleDouble() {
+	Expression* f = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Variable("y")),
+		BinaryOperation::MINUS, new Variable("x"));
+	Compiler compiler;
+	Program program = compiler.compile(f);
+	size_t const n = 1 << 20;
+	std::vector<double> x(n, 1e17), y(n), out(n), hi(n), lo(n);
+	for (size_t i = 0; i < n; ++i)
+		y[i] = double(i % 1000);
+	std::vector<double const*> columns(2);
+	columns[program.variableIndex("x")] = x.data();
+	columns[program.variableIndex("y")] = y.data();
+
+	auto t0 = std::chrono::steady_clock::now();
+	program.run(columns, n, out.data());
+	auto t1 = std::chrono::steady_clock::now();
+	program.runDoubleDouble(columns, n, hi.data(), lo.data());
+	auto t2 = std::chrono::steady_clock::now();
+
+	double errDouble = 0.0, errDD = 0.0;
+	for (size_t i = 0; i < n; ++i) {
+		errDouble = std::max(errDouble, std::fabs(out[i] - y[i]));
+		errDD = std::max(errDD, std::fabs((hi[i] - y[i]) + lo[i]));
+	}
+	double nsDouble = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+	double nsDD = std::chrono::duration<double, std::nano>(t2 - t1).count() / n;
+	std::cout << "double:        max error " << errDouble << ", " << nsDouble << " ns/row" << std::endl;
+	std::cout << "double-double: max error " << errDD << ", " << nsDD << " ns/row" << std::endl;
+	delete f;
+}
+
+Expression* balancedTree(int depth, Random& random) { // случайное полное дерево для замеров
+	if (depth == 0)
+		return random.uniform() < 0.25 ? static_cast<Expression*>(new Variable("x")) : new Number(1.0 + random.uniform());
+	if (random.uniform() < 0.1)
+		return new FunctionCall(random.uniform() < 0.5 ? "sqrt" : "abs", balancedTree(depth - 1, random));
+	static int const ops[4] = { BinaryOperation::PLUS, BinaryOperation::MINUS, BinaryOperation::MUL, BinaryOperation::DIV };
+	Expression* left = balancedTree(depth - 1, random);
+	return new BinaryOperation(left, ops[random.below(4)], balancedTree(depth - 1, random));
+}
+
+
+// Счётчики вокруг обхода дерева: evaluate и оба преобразователя. Разбора текста в проекте нет, поэтому и замера для него нет.
+void benchmarkTree() {
+	PerfCounters counters;
+	Random random(1);
+	Expression* tree = balancedTree(18, random);
+	size_t nodes = Population::size(tree);
+	double sink = 0.0;
+	benchmarkCase(counters, "evaluate", nodes, 10, [&]() { sink += tree->evaluate(); });
+	PackedTree packed(tree);
+	std::vector<double> values(packed.symbols().size(), 0.0);
+	benchmarkCase(counters, "PackedTree evaluate", nodes, 10, [&]() { sink += packed.evaluate(values); });
+	benchmarkCase(counters, "CopySyntaxTree", nodes, 3, [&]() {
+		CopySyntaxTree copy;
+		delete tree->transform(&copy);
+	});
+	benchmarkCase(counters, "FoldConstants", nodes, 3, [&]() {
+		FoldConstants fold;
+		delete tree->transform(&fold);
+	});
+	benchmarkCase(counters, "FoldConstants in RequestScope", nodes, 3, [&]() {
+		RequestScope scope;
+		FoldConstants fold;
+		tree->transform(&fold);
+	});
+	if (sink == 42.0)
+		std::cout << sink << std::endl; // не даёт выбросить вычисление
+	delete tree;
+}
+
+
+// Полное вычисление упакованного дерева при разных раскладках узлов, от ~10^4 до ~10^7 узлов.
+// Больше исходное дерево из отдельных объектов в память стенда не помещается.
+void benchmarkLayout() {
+	PerfCounters counters;
+	static char const* const names[3] = { "preorder", "breadth-first", "van Emde Boas" };
+	for (int depth : { 15, 18, 21, 24 }) {
+		Random random(static_cast<uint64_t>(depth));
+		Expression* tree = balancedTree(depth, random);
+		PackedTree packed(tree);
+		delete tree;
+		std::vector<double> values(packed.symbols().size(), 0.0);
+		int repeat = std::max(1, int((size_t(1) << 23) / packed.nodes()));
+		double sink = 0.0;
+		for (int layout = PackedTree::PREORDER; layout <= PackedTree::VAN_EMDE_BOAS; ++layout) {
+			packed.relayout(layout);
+			std::string name = std::to_string(packed.nodes()) + " nodes, " + names[layout];
+			benchmarkCase(counters, name.c_str(), packed.nodes(), repeat, [&]() { sink += packed.evaluate(values); });
+		}
+		if (sink == 42.0)
+			std::cout << sink << std::endl;
+	}
+}
+// Цена детерминированной суммы по сравнению с быстрой на 2^24 строках.
+void benchmarkParallel() {
+	Expression* f = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Variable("x")),
+		BinaryOperation::PLUS, new FunctionCall("sqrt", new Variable("x")));
+	Program program = Compiler().compile(f);
+	delete f;
+	size_t const n = size_t(1) << 24;
+	std::vector<double> x(n);
+	Random random(7);
+	for (double& v : x)
+		v = random.uniform();
+	std::vector<double const*> columns(1, x.data());
+	for (int mode = ParallelBatch::FAST; mode <= ParallelBatch::DETERMINISTIC; ++mode) {
+		ParallelBatch batch(program, mode);
+		auto start = std::chrono::steady_clock::now();
+		double total = batch.sum(columns, n);
+		auto finish = std::chrono::steady_clock::now();
+		std::cout << (mode == ParallelBatch::FAST ? "parallel sum, fast:          " : "parallel sum, deterministic: ")
+			<< std::chrono::duration<double, std::nano>(finish - start).count() / double(n) << " ns/row, " << total << std::endl;
+	}
+}
+Expression* columnFormula(int depth, std::vector<std::string> const& names, Random& random) { // случайная формула по столбцам
+	if (depth == 0)
+		return random.uniform() < 0.8 ? static_cast<Expression*>(new Variable(names[random.below(names.size())])) : new Number(random.uniform());
+	static int const ops[3] = { BinaryOperation::PLUS, BinaryOperation::MINUS, BinaryOperation::MUL };
+	Expression* left = columnFormula(depth - 1, names, random);
+	return new BinaryOperation(left, ops[random.below(3)], columnFormula(depth - 1, names, random));
+}
+// Сотня формул над общими столбцами: каждая формула по всем строкам против плиток размера из autotune.
+void benchmarkTiled() {
+	enum { FORMULAS = 100, COLUMNS = 8 };
+	size_t const n = size_t(1) << 18;
+	Random random(11);
+	std::vector<std::string> names;
+	std::vector<std::vector<double>> data(COLUMNS, std::vector<double>(n));
+	std::vector<double const*> columns;
+	for (int c = 0; c < COLUMNS; ++c) {
+		names.push_back("c" + std::to_string(c));
+		for (double& v : data[c])
+			v = 1.0 + random.uniform();
+		columns.push_back(data[c].data());
+	}
+	Compiler compiler;
+	std::vector<Program> programs;
+	for (int f = 0; f < FORMULAS; ++f) {
+		Expression* expr = columnFormula(3, names, random);
+		programs.push_back(compiler.compile(expr));
+		delete expr;
+	}
+	std::vector<Program const*> pointers;
+	for (Program const& program : programs)
+		pointers.push_back(&program);
+	std::vector<std::vector<double>> results(FORMULAS, std::vector<double>(n));
+	std::vector<double*> outs;
+	for (std::vector<double>& result : results)
+		outs.push_back(result.data());
+
+	TiledBatch batch(pointers, names);
+	batch.setTile(n); // плитка во все строки — то же, что каждая формула по отдельности
+	auto t0 = std::chrono::steady_clock::now();
+	batch.run(columns, n, outs);
+	auto t1 = std::chrono::steady_clock::now();
+	size_t tile = batch.autotune(columns, n, outs);
+	auto t2 = std::chrono::steady_clock::now();
+	batch.run(columns, n, outs);
+	auto t3 = std::chrono::steady_clock::now();
+	double rows = double(n) * FORMULAS;
+	std::cout << "formula by formula: " << std::chrono::duration<double, std::nano>(t1 - t0).count() / rows << " ns/row" << std::endl;
+	std::cout << "tiled, " << tile << " rows: " << std::chrono::duration<double, std::nano>(t3 - t2).count() / rows << " ns/row" << std::endl;
+}
+// Одно вычисление дерева из ~4 * 10^6 узлов: последовательно и по графу задач на всех ядрах.
+void benchmarkTaskGraph() {
+	PerfCounters counters;
+	Random random(5);
+	Expression* tree = balancedTree(22, random);
+	PackedTree packed(tree);
+	delete tree;
+	std::vector<double> values(packed.symbols().size(), 0.5);
+	TaskGraph graph(packed);
+	double sequential = 0.0, parallel = 0.0;
+	benchmarkCase(counters, "PackedTree evaluate, one thread", packed.nodes(), 5, [&]() { sequential = packed.evaluate(values); });
+	std::string name = "TaskGraph evaluate, " + std::to_string(graph.tasks()) + " tasks";
+	benchmarkCase(counters, name.c_str(), packed.nodes(), 5, [&]() { parallel = graph.evaluate(values); });
+	std::cout << "same result: " << (sequential == parallel || (sequential != sequential && parallel != parallel)) << std::endl;
+}
+void runBenchmarks() {
+	benchmarkDoubleDouble();
+	benchmarkTree();
+	benchmarkLayout();
+	benchmarkParallel();
+	benchmarkTiled();
+	benchmarkTaskGraph();
+}
+
+
+// Самопроверка (--test): каждая проверка печатает строку "ok" или "FAIL" с именем; итог — все ли прошли.
+// Многопоточные проверки имеет смысл запускать и в сборках с -fsanitize=thread и -fsanitize=address.
+bool check(char const* name, bool ok) {
+	std::cout << (ok ? "ok    " : "FAIL  ") << name << std::endl;
+	return ok;
+}
+
+bool testDoubleDouble() {
+	Expression* f = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::DIV, new Variable("y")),
+		BinaryOperation::MUL, new Variable("y"));
+	Program program = Compiler().compile(f);
+	delete f;
+	std::vector<double> x{ 1e300, 4.0 }, y{ 1e-10, 2.0 }, hi(2), lo(2);
+	std::vector<double const*> columns(2);
+	columns[program.variableIndex("x")] = x.data();
+	columns[program.variableIndex("y")] = y.data();
+	program.runDoubleDouble(columns, 2, hi.data(), lo.data());
+	bool ok = check("double-double: overflow gives inf", hi[0] == INFINITY && hi[1] == 4.0 && lo[1] == 0.0);
+
+	Expression* g = new FunctionCall("sqrt", new Variable("x"));
+	Program root = Compiler().compile(g);
+	delete g;
+	std::vector<double> z{ INFINITY, 4.0 };
+	std::vector<double const*> column(1, z.data());
+	root.runDoubleDouble(column, 2, hi.data(), lo.data());
+	ok = check("double-double: sqrt(inf) = inf", hi[0] == INFINITY && hi[1] == 2.0) && ok;
+
+	Expression* cancel = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Variable("y")),
+		BinaryOperation::MINUS, new Variable("x"));
+	Program exact = Compiler().compile(cancel);
+	delete cancel;
+	size_t const n = 1000; // несколько блоков и неполный последний
+	std::vector<double> big(n, 1e17), small(n), rowsHi(n), rowsLo(n);
+	for (size_t i = 0; i < n; ++i)
+		small[i] = double(i % 97) + 0.25;
+	columns[exact.variableIndex("x")] = big.data();
+	columns[exact.variableIndex("y")] = small.data();
+	exact.runDoubleDouble(columns, n, rowsHi.data(), rowsLo.data());
+	bool same = true;
+	for (size_t i = 0; i < n; ++i)
+		same = same && rowsHi[i] + rowsLo[i] == small[i];
+	return check("double-double: (x + y) - x exact for x = 1e17", same) && ok;
+}
+
+bool testFixedPoint() { // x / (1.4 - x): при x из [0, 4] знаменатель может обнулиться
+	Expression* f = new BinaryOperation(new Variable("x"), BinaryOperation::DIV,
+		new BinaryOperation(new Number(1.4), BinaryOperation::MINUS, new Variable("x")));
+	Program program = Compiler(SIZE_MAX).compile(f);
+	delete f;
+	int64_t in = int64_t(std::llround(std::ldexp(3.19, 32))), out = 0;
+	FixedPointProgram unusable(program, { Interval{ 0.0, 4.0 } }, 32, FixedPointProgram::CHECKED);
+	bool ok = check("fixed point: unusable scale rejected", !unusable.valid() && !unusable.evaluate(&in, out));
+	FixedPointProgram usable(program, { Interval{ 2.0, 4.0 } }, 32, FixedPointProgram::CHECKED);
+	bool done = usable.valid() && usable.evaluate(&in, out);
+	ok = check("fixed point: usable scale", done && std::fabs(std::ldexp(double(out), -usable.resultFrac()) - 3.19 / (1.4 - 3.19)) < 1e-6) && ok;
+
+	// Вход за объявленным диапазоном переполняет x * x: SATURATE прижимает к границе, CHECKED отказывает.
+	Expression* square = new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Variable("x"));
+	Program squared = Compiler(SIZE_MAX).compile(square);
+	delete square;
+	int64_t huge = int64_t(1) << 52; // 2^20 в Q.32
+	int64_t saturated = 0, checked = 0;
+	bool clamped = FixedPointProgram(squared, { Interval{ -2.0, 2.0 } }, 32, FixedPointProgram::SATURATE).evaluate(&huge, saturated);
+	bool refused = !FixedPointProgram(squared, { Interval{ -2.0, 2.0 } }, 32, FixedPointProgram::CHECKED).evaluate(&huge, checked);
+	Expression* root = new FunctionCall("sqrt", new Variable("x"));
+	Program rooted = Compiler(SIZE_MAX).compile(root);
+	delete root;
+	int64_t negative = -(int64_t(1) << 32), zero = 1;
+	bool rootZero = FixedPointProgram(rooted, { Interval{ -1.0, 1.0 } }, 32, FixedPointProgram::SATURATE).evaluate(&negative, zero) && zero == 0;
+	ok = check("fixed point: SATURATE clamps, CHECKED refuses", clamped && saturated == INT64_MAX && refused && rootZero) && ok;
+
+	// let, abs, sqrt и деление на отделённый от нуля знаменатель (анализ диапазонов не знает, что x * x >= 0) против evaluate.
+	Expression* formula = new Let("y", new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Number(0.75)),
+		BinaryOperation::PLUS, new Variable("z")),
+		new BinaryOperation(new FunctionCall("sqrt", new FunctionCall("abs", new BinaryOperation(new Variable("y"), BinaryOperation::MINUS, new Number(3.0)))),
+			BinaryOperation::PLUS, new BinaryOperation(new BinaryOperation(new Variable("y"), BinaryOperation::MUL, new Variable("x")),
+				BinaryOperation::DIV, new BinaryOperation(new BinaryOperation(new FunctionCall("abs", new Variable("x")), BinaryOperation::MUL,
+					new FunctionCall("abs", new Variable("x"))),
+					BinaryOperation::PLUS, new Number(1.0)))));
+	Program mixed = Compiler(SIZE_MAX).compile(formula);
+	std::vector<Interval> ranges(mixed.variables.size(), Interval{ -8.0, 8.0 });
+	FixedPointProgram fixed(mixed, ranges, 32, FixedPointProgram::CHECKED);
+	Random random(77);
+	double worst = 0.0;
+	bool evaluated = fixed.valid();
+	std::vector<std::pair<std::string, double>>& bindings = Environment::bindings();
+	for (int i = 0; i < 1000 && evaluated; ++i) {
+		std::vector<int64_t> inputs;
+		for (std::string const& name : mixed.variables) {
+			double v = std::ldexp(std::floor(std::ldexp((random.uniform() - 0.5) * 16.0, 32)), -32); // точно в Q.32
+			inputs.push_back(int64_t(std::ldexp(v, 32)));
+			bindings.emplace_back(name, v);
+		}
+		double expected = formula->evaluate();
+		bindings.resize(bindings.size() - mixed.variables.size());
+		int64_t result = 0;
+		evaluated = fixed.evaluate(inputs.data(), result);
+		worst = std::max(worst, std::fabs(std::ldexp(double(result), -fixed.resultFrac()) - expected));
+	}
+	delete formula;
+	return check("fixed point: matches double within 2^-20", evaluated && worst < std::ldexp(1.0, -20)) && ok;
+}
+
+bool testNewton() {
+	// x^2 - 2 на [0, 2] и [-2, 0]: оба корня
+	Expression* f = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Variable("x")),
+		BinaryOperation::MINUS, new Number(2.0));
+	NewtonSolver solver(f, "x");
+	delete f;
+	double target[3] = { 0.0, 0.0, 0.0 }, lo[2] = { 0.0, -2.0 }, hi[2] = { 2.0, 0.0 }, root[3];
+	size_t converged = solver.solve({}, target, lo, hi, 2, root);
+	bool ok = check("NewtonSolver: roots of x^2 - 2", converged == 2
+		&& std::fabs(root[0] - std::sqrt(2.0)) < 1e-12 && std::fabs(root[1] + std::sqrt(2.0)) < 1e-12);
+
+	// x - 2 + sqrt(x^2 - 1): на концах [-3, 3] знаки разные, корень 1.25, а в середине NaN. Раньше NaN шёл
+	// в «положительный» конец скобки, и решатель сходился к -1, где корня нет. Скобка [1, 3] обходит NaN,
+	// а у [-0.5, 3] NaN на конце.
+	Expression* g = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MINUS, new Number(2.0)),
+		BinaryOperation::PLUS, new FunctionCall("sqrt", new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MUL,
+			new Variable("x")), BinaryOperation::MINUS, new Number(1.0))));
+	NewtonSolver partial(g, "x");
+	delete g;
+	double guessLo[3] = { -3.0, 1.0, -0.5 }, guessHi[3] = { 3.0, 3.0, 3.0 };
+	converged = partial.solve({}, target, guessLo, guessHi, 3, root);
+	return check("NewtonSolver: NaN inside the bracket fails the row", converged == 1
+		&& std::isnan(root[0]) && std::fabs(root[1] - 1.25) < 1e-12 && std::isnan(root[2])) && ok;
+}
+
+bool testMonteCarlo() { // sqrt(x) * y + x / (y + 3), x ~ U[0, 4), y ~ N(1, 0.5): среднее около 4/3 + 2 * 0.2539
+	Expression* f = new BinaryOperation(new BinaryOperation(new FunctionCall("sqrt", new Variable("x")), BinaryOperation::MUL, new Variable("y")),
+		BinaryOperation::PLUS, new BinaryOperation(new Variable("x"), BinaryOperation::DIV,
+			new BinaryOperation(new Variable("y"), BinaryOperation::PLUS, new Number(3.0))));
+	MonteCarlo monteCarlo(f);
+	delete f;
+	monteCarlo.bind("x", Distribution{ Distribution::UNIFORM, 0.0, 4.0 });
+	monteCarlo.bind("y", Distribution{ Distribution::NORMAL, 1.0, 0.5 });
+	uint64_t const samples = 100003; // неполный последний блок
+	MonteCarloResult one = monteCarlo.run(samples, 42, 1);
+	bool same = true;
+	for (unsigned threads : { 2u, 3u, 8u }) {
+		MonteCarloResult many = monteCarlo.run(samples, 42, threads);
+		same = same && many.samples == one.samples && many.mean == one.mean && many.variance == one.variance;
+		for (double q : { 0.01, 0.5, 0.99 })
+			same = same && many.quantile(q) == one.quantile(q);
+	}
+	bool ok = check("MonteCarlo: same result for 1, 2, 3 and 8 threads", same);
+	bool other = monteCarlo.run(samples, 43, 1).mean != one.mean;
+	return check("MonteCarlo: mean near 1.841, seed matters", one.samples == samples && std::fabs(one.mean - 1.841) < 0.02 && other) && ok;
+}
+
+struct Probe : Number { // узел, который держит память вне себя; считает живые экземпляры
+	static int& alive() {
+		static int alive = 0;
+		return alive;
+	}
+	explicit Probe(double value) : Number(value) {
+		++alive();
+		track();
+	}
+	~Probe() { --alive(); }
+	bool holds() const { return true; }
+};
+size_t treeDepth(Expression const* expr) {
+	if (BinaryOperation const* binop = dynamic_cast<BinaryOperation const*>(expr))
+		return 1 + std::max(treeDepth(binop->left()), treeDepth(binop->right()));
+	if (FunctionCall const* fcall = dynamic_cast<FunctionCall const*>(expr))
+		return 1 + treeDepth(fcall->arg());
+	return 1;
+}
+bool testPopulation() {
+	bool destroyed = true;
+	{
+		Arena arena;
+		Expression const* shared = arena.make<Probe>(1.0);
+		Expression const* sum = arena.make<BinaryOperation>(shared, BinaryOperation::PLUS, shared);
+		arena.make<Reduction>(Reduction::SUM, arena.make<BinaryOperation>(sum, BinaryOperation::MUL,
+			arena.make<Variable>("an_array_name_longer_than_the_string_buffer")));
+		Arena::Mark mark = arena.mark();
+		arena.make<Probe>(2.0);
+		arena.make<Probe>(3.0);
+		destroyed = Probe::alive() == 3;
+		arena.rewind(mark);
+		destroyed = destroyed && Probe::alive() == 1;
+		arena.make<Probe>(4.0);
+	}
+	bool ok = check("Arena: destructors of nodes with memory, shared children once", destroyed && Probe::alive() == 0);
+
+	std::vector<std::string> names{ "first_variable_with_a_long_name", "second_variable_with_a_long_name" };
+	Population population(names, 5), twin(names, 5);
+	population.initialize(60, 6);
+	twin.initialize(60, 6);
+	bool parents = true, path = true, repeatable = true;
+	size_t changed = 0, rounds = 300;
+	size_t const node = std::max(sizeof(BinaryOperation), sizeof(FunctionCall)) + alignof(std::max_align_t);
+	for (size_t round = 0; round < rounds; ++round) {
+		size_t i = round % population.individuals.size(), j = (round * 7 + 3) % population.individuals.size();
+		Expression const* a = population.individuals[i];
+		Expression const* b = population.individuals[j];
+		std::string before = a->print(), donor = b->print();
+		size_t bytes = population.arena().bytes();
+		Expression const* child = population.crossover(a, b);
+		path = path && population.arena().bytes() - bytes <= treeDepth(a) * node; // копируется только путь до узла
+		Expression const* mutant = population.mutate(child, 3);
+		parents = parents && a->print() == before && b->print() == donor;
+		changed += child->print() != before;
+		Expression const* copy = twin.mutate(twin.crossover(twin.individuals[i], twin.individuals[j]), 3);
+		repeatable = repeatable && copy->print() == mutant->print();
+		population.individuals[i] = mutant;
+		twin.individuals[i] = copy;
+	}
+	ok = check("Population: crossover copies only the path, parents unchanged", parents && path && changed > rounds / 2) && ok;
+	return check("Population: same seed, same offspring", repeatable) && ok;
+}
+
+bool sameCode(std::vector<Instruction> const& a, std::vector<Instruction> const& b) {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i)
+		if (a[i].kind != b[i].kind || a[i].arg != b[i].arg)
+			return false;
+	return true;
+}
+bool testCompileCache() {
+	FunctionRegistry::instance().define("test_square", { "u" },
+		new BinaryOperation(new Variable("u"), BinaryOperation::MUL, new Variable("u")));
+	bool operands = true;
+	for (uint64_t seed = 1; seed < 100; ++seed) {
+		Random random(seed);
+		Expression* expr = new Let("y", new FunctionCall("test_square", balancedTree(6, random)),
+			new BinaryOperation(new Variable("y"), BinaryOperation::PLUS, new FunctionCall("test_square", new Variable("z"))));
+		for (size_t limit : { size_t(0), size_t(32) }) {
+			Compiler compiler(limit);
+			Program program = compiler.compile(expr);
+			Compiler::Operands found = compiler.operands(expr);
+			operands = operands && program.constants == found.constants && program.variables == found.variables
+				&& sameCode(program.code, found.code) && program.functions == found.functions && program.locals == found.locals;
+		}
+		delete expr;
+	}
+	bool ok = check("Compiler::operands matches compile", operands);
+
+	// Формы одного размера с одними столбцами: защита кэша от коллизий хеша должна их различать.
+	Expression* plus = new BinaryOperation(new Variable("a"), BinaryOperation::PLUS, new Variable("b"));
+	Expression* mul = new BinaryOperation(new Variable("a"), BinaryOperation::MUL, new Variable("b"));
+	Compiler compiler;
+	Program kernel = compiler.compile(plus);
+	ok = check("Compiler::operands: a*b differs from the kernel of a+b",
+		!sameCode(kernel.code, compiler.operands(mul).code) && sameCode(kernel.code, compiler.operands(plus).code)) && ok;
+	CompileCache shapes;
+	double a = 2.0, b = 5.0, out[2];
+	std::vector<double const*> columns = { &a, &b };
+	shapes.compile(plus).run(columns, 1, &out[0]);
+	shapes.compile(mul).run(columns, 1, &out[1]);
+	ok = check("CompileCache: same-size shapes get their own kernels", out[0] == 7.0 && out[1] == 10.0 && shapes.size() == 2) && ok;
+	delete plus;
+	delete mul;
+
+	CompileCache cache;
+	bool params = true;
+	for (int i = 0; i < 10; ++i) {
+		Expression* expr = new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Number(i));
+		params = params && cache.compile(expr).params[0] == i;
+		delete expr;
+	}
+	return check("CompileCache: one compile, constants as parameters", params && cache.hits() == 9 && cache.misses() == 1) && ok;
+}
+
+Expression* packShape(int k) { // одна форма, константы зависят от k
+	Expression* y = new BinaryOperation(new BinaryOperation(new Number(k + 1.0), BinaryOperation::MUL, new Variable("x")),
+		BinaryOperation::MINUS, new Number(k / 3.0));
+	Expression* body = new BinaryOperation(new FunctionCall("test_pack", { new Variable("y"), new Variable("x") }), BinaryOperation::PLUS,
+		new BinaryOperation(new FunctionCall("sqrt", new FunctionCall("abs", new Variable("y"))), BinaryOperation::DIV,
+			new BinaryOperation(new BinaryOperation(new Variable("y"), BinaryOperation::MUL, new Variable("y")), BinaryOperation::PLUS, new Number(k))));
+	return new Let("y", y, body);
+}
+bool testFormulaPack() { // дорожки против Program::run каждой формулы, в том числе неполная последняя группа
+	Expression* body = new Variable("u");
+	for (int i = 0; i < 12; ++i) // длиннее INLINE_LIMIT: вызов остаётся командой CALL
+		body = new BinaryOperation(new BinaryOperation(body, BinaryOperation::MUL, new Variable("v")), BinaryOperation::PLUS, new Number(i));
+	FunctionRegistry::instance().define("test_pack", { "u", "v" }, body);
+	CompileCache cache;
+	bool same = true, called = true;
+	for (size_t count : { size_t(1), size_t(FormulaPack::LANES), size_t(13), size_t(19) }) {
+		std::vector<CompiledFormula> formulas;
+		for (size_t k = 0; k < count; ++k) {
+			Expression* expr = packShape(int(k));
+			formulas.push_back(cache.compile(expr));
+			delete expr;
+		}
+		called = called && formulas[0].kernel->functions.size() == 1;
+		FormulaPack pack(formulas);
+		double x = 0.7;
+		std::vector<double> out(count);
+		pack.run(&x, out.data());
+		std::vector<double const*> columns(1, &x);
+		for (size_t k = 0; k < count; ++k) {
+			double expected;
+			formulas[k].kernel->run(columns, 1, &expected, formulas[k].params.data());
+			same = same && (out[k] == expected || (out[k] != out[k] && expected != expected));
+		}
+	}
+	return check("FormulaPack: lanes equal Program::run for 1, 8, 13 and 19 formulas", same && called && cache.size() == 1);
+}
+
+bool metricName(std::string const& name) { // [a-zA-Z_:][a-zA-Z0-9_:]*
+	if (name.empty() || std::isdigit((unsigned char)name[0]))
+		return false;
+	for (char c : name)
+		if (!std::isalnum((unsigned char)c) && c != '_' && c != ':')
+			return false;
+	return true;
+}
+bool testMetrics() { // разбор выгрузки по правилам текстового формата Prometheus
+	Metrics& metrics = Metrics::instance();
+	metrics.enabled = true;
+	CompileCache cache;
+	Expression* expr = new BinaryOperation(new Variable("x"), BinaryOperation::DIV, new Number(0.0));
+	double x = 0.0, out;
+	cache.compile(expr).run(std::vector<double const*>(1, &x), 1, &out);
+	metrics.evaluate(expr);
+	metrics.enabled = false;
+	delete expr;
+
+	std::ostringstream text;
+	metrics.writePrometheus(text);
+	std::istringstream lines(text.str());
+	std::unordered_map<std::string, std::string> types; // семейство -> тип
+	std::unordered_map<std::string, double> samples; // имя с метками -> значение
+	bool format = true;
+	for (std::string line; std::getline(lines, line); ) {
+		if (line.compare(0, 7, "# TYPE ") == 0) {
+			std::istringstream fields(line.substr(7));
+			std::string family, type, extra;
+			fields >> family >> type;
+			format = format && metricName(family) && !(fields >> extra) && !types.count(family)
+				&& (type == "counter" || type == "gauge" || type == "summary" || type == "histogram");
+			types[family] = type;
+			continue;
+		}
+		size_t space = line.rfind(' ');
+		if (line.empty() || line[0] == '#' || space == std::string::npos) {
+			format = format && line.compare(0, 2, "# ") == 0;
+			continue;
+		}
+		std::string key = line.substr(0, space), name = key.substr(0, key.find('{'));
+		if (name.size() < key.size()) { // {имя="значение",...}
+			std::string labels = key.substr(name.size());
+			format = format && labels.back() == '}';
+			for (size_t at = 1; format && at + 1 < labels.size(); ) {
+				size_t eq = labels.find("=\"", at), close = labels.find('"', eq + 2);
+				format = eq != std::string::npos && close != std::string::npos && metricName(labels.substr(at, eq - at))
+					&& (labels[close + 1] == ',' || close + 2 == labels.size());
+				at = close + 2;
+			}
+		}
+		char* end;
+		std::string value = line.substr(space + 1);
+		samples[key] = std::strtod(value.c_str(), &end);
+		format = format && metricName(name) && !value.empty() && *end == '\0';
+		std::string family = name; // у summary отсчёты _sum и _count принадлежат семейству без суффикса
+		for (char const* suffix : { "_sum", "_count" })
+			if (!types.count(family) && family.size() > std::strlen(suffix)
+				&& family.compare(family.size() - std::strlen(suffix), std::string::npos, suffix) == 0)
+				family.erase(family.size() - std::strlen(suffix));
+		format = format && types.count(family) // TYPE раньше отсчётов
+			&& (types[family] != "counter" || (name.size() > 6 && name.compare(name.size() - 6, 6, "_total") == 0));
+	}
+	bool ok = check("Metrics: output follows the Prometheus text format", format);
+	bool summary = true;
+	for (char const* path : { "scalar", "batch", "compile" }) {
+		std::string labels = std::string("{path=\"") + path + "\"";
+		summary = summary && samples.count("formula_latency_seconds_sum" + labels + "}")
+			&& samples.count("formula_latency_seconds_count" + labels + "}")
+			&& samples.count("formula_latency_seconds" + labels + ",quantile=\"0.99\"}");
+	}
+	return check("Metrics: every path has quantiles, _sum and _count", summary
+		&& samples["formula_latency_seconds_count{path=\"scalar\"}"] >= 1 && samples["formula_latency_seconds_count{path=\"compile\"}"] >= 1
+		&& samples["formula_compiles_total"] >= 1 && samples["formula_domain_errors_total"] >= 2) && ok;
+}
+
+Expression* streamTree(int depth, Random& random) { // let с затенением имён, вызовы функций и столбец x
+	if (depth == 0) {
+		double u = random.uniform();
+		if (u < 0.5)
+			return new Variable(u < 0.3 ? "x" : "y");
+		return new Number(u - 0.7);
+	}
+	double u = random.uniform();
+	if (u < 0.2)
+		return new Let("y", streamTree(depth - 1, random), streamTree(depth - 1, random));
+	if (u < 0.3)
+		return new FunctionCall(random.uniform() < 0.5 ? "sqrt" : "abs", streamTree(depth - 1, random));
+	if (u < 0.4)
+		return new FunctionCall("test_stream", { streamTree(depth - 1, random), streamTree(depth - 1, random) });
+	static int const ops[4] = { BinaryOperation::PLUS, BinaryOperation::MINUS, BinaryOperation::MUL, BinaryOperation::DIV };
+	Expression* left = streamTree(depth - 1, random);
+	return new BinaryOperation(left, ops[random.below(4)], streamTree(depth - 1, random));
+}
+bool testStream() { // запись дерева, потоковое вычисление и сравнение с evaluate по строкам
+	FunctionRegistry::instance().define("test_stream", { "u", "v" },
+		new BinaryOperation(new BinaryOperation(new Variable("u"), BinaryOperation::MUL, new Variable("v")), BinaryOperation::MINUS, new Variable("u")));
+	double const xs[] = { -2.0, -0.5, 0.0, 0.25, 1.0, 3.0, 40.0 };
+	size_t const n = sizeof(xs) / sizeof(xs[0]);
+	std::unordered_map<std::string, double const*> columns = { { "x", xs } };
+	StreamEvaluator evaluator;
+	bool same = true, truncated = true;
+	for (uint64_t seed = 1; seed <= 200; ++seed) {
+		Random random(seed);
+		Expression* expr = new Let("y", streamTree(3, random), streamTree(5, random)); // последняя запись — конец области
+		std::ostringstream buffer;
+		PostorderWriter(buffer).write(expr);
+		std::string const bytes = buffer.str();
+		double out[n];
+		std::istringstream in(bytes);
+		StreamSource stream(in);
+		MemorySource memory(bytes.data(), bytes.size());
+		bool read = evaluator.evaluate(stream, columns, n, out);
+		for (size_t i = 0; i < n; ++i) {
+			Environment::bindings().emplace_back("x", xs[i]);
+			double expected = expr->evaluate();
+			Environment::bindings().pop_back();
+			same = same && read && (out[i] == expected || (out[i] != out[i] && expected != expected));
+		}
+		same = same && evaluator.evaluate(memory, columns, n, out);
+		MemorySource cut(bytes.data(), bytes.size() - 1); // без конца области let
+		uint16_t length; // первая запись — лист: число или переменная с именем
+		std::memcpy(&length, bytes.data() + 1, sizeof(length));
+		size_t first = bytes[0] == Instruction::CONST ? 1 + sizeof(double) : 1 + sizeof(length) + length;
+		MemorySource half(bytes.data(), 1 + random.below(first - 1)); // обрыв внутри первой записи
+		truncated = truncated && !evaluator.evaluate(cut, columns, n, out) && !evaluator.evaluate(half, columns, n, out);
+		delete expr;
+	}
+	bool ok = check("StreamEvaluator: round trip equals evaluate", same);
+	ok = check("StreamEvaluator: truncated stream rejected", truncated) && ok;
+
+	std::ostringstream buffer;
+	PostorderWriter writer(buffer);
+	writer.number(1.0); // два выражения подряд
+	writer.number(2.0);
+	std::string const twoValues = buffer.str();
+	buffer.str(std::string());
+	writer.number(1.0);
+	writer.number(2.0);
+	writer.binary(7); // нет такой операции
+	std::string const badOperation = buffer.str();
+	buffer.str(std::string());
+	writer.number(1.0);
+	writer.unbind(); // конец области без начала
+	std::string const badScope = buffer.str();
+	buffer.str(std::string());
+	writer.number(1.0);
+	writer.call("test_stream_missing");
+	std::string const missing = buffer.str();
+	buffer.str(std::string());
+	writer.binary(BinaryOperation::PLUS); // операция без операндов
+	std::string const empty = buffer.str() + std::string(1, char(0x7f));
+	bool malformed = true;
+	double out[n];
+	for (std::string const* bytes : { &twoValues, &badOperation, &badScope, &missing, &empty }) {
+		MemorySource source(bytes->data(), bytes->size());
+		malformed = malformed && !evaluator.evaluate(source, columns, n, out);
+	}
+	std::string const unknown(1, char(0x7f)); // неизвестный тег
+	MemorySource source(unknown.data(), unknown.size());
+	return check("StreamEvaluator: malformed stream rejected", malformed && !evaluator.evaluate(source, columns, n, out)) && ok;
+}
+
+CorpusProfile roundTrip(CorpusProfile const& profile, uint64_t seed) {
+	CorpusGenerator generator(profile, seed);
+	Arena arena;
+	std::vector<Expression const*> corpus;
+	for (int i = 0; i < 3000; ++i)
+		corpus.push_back(generator.next(arena));
+	return CorpusProfile::measure(corpus);
+}
+bool testCorpus() {
+	bool sizes = true, chain = true;
+	for (double share : { 0.0, 0.2, 0.5, 0.9 }) {
+		CorpusProfile profile;
+		profile.sizes = { 2, 7, 19, 31 };
+		profile.chain = share;
+		CorpusProfile measured = roundTrip(profile, 1), again = roundTrip(measured, 2);
+		for (size_t size : measured.sizes)
+			sizes = sizes && std::find(profile.sizes.begin(), profile.sizes.end(), size) != profile.sizes.end();
+		chain = chain && std::fabs(measured.chain - share) < 0.03 && std::fabs(again.chain - measured.chain) < 0.03;
+	}
+	return check("CorpusGenerator: exact sizes", sizes) & check("CorpusProfile: chain survives a round trip", chain);
+}
+
+bool testFormulaLibrary() { // читатели без блокировок на фоне 2000 замен
+	FormulaLibrary library;
+	CompileCache cache;
+	std::atomic<bool> stop(false);
+	std::atomic<int> bad(0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 3; ++t)
+		readers.emplace_back([&]() {
+			double x = 2.0, out = 0.0;
+			std::vector<double const*> columns(1, &x);
+			while (!stop.load()) {
+				FormulaLibrary::Reader reader(library);
+				CompiledFormula const* formula = reader.find("f");
+				if (!formula)
+					continue;
+				FormulaLibrary::Reader nested(library);
+				formula->run(columns, 1, &out);
+				if (out < 0.0 || out != std::floor(out))
+					++bad;
+			}
+		});
+	for (int i = 0; i < 2000; ++i) {
+		Expression* expr = new BinaryOperation(new Number(i), BinaryOperation::MUL, new Variable("x"));
+		CompiledFormula formula = cache.compile(expr);
+		delete expr;
+		library.update([&](FormulaLibrary::Snapshot& snapshot) { snapshot["f"] = formula; });
+	}
+	stop = true;
+	for (std::thread& reader : readers)
+		reader.join();
+	library.reclaim();
+	return check("FormulaLibrary: concurrent readers and 2000 updates", bad == 0 && library.pending() == 0);
+}
+
+bool testLet() { // одна формула с затенением имён в evaluate, Program, FixedPointProgram и потоке
+	// let y = x + 1 in (let y = y * 2 in y * y) - y / (let z = y in z + x)
+	Expression* expr = new Let("y", new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Number(1.0)),
+		new BinaryOperation(
+			new Let("y", new BinaryOperation(new Variable("y"), BinaryOperation::MUL, new Number(2.0)),
+				new BinaryOperation(new Variable("y"), BinaryOperation::MUL, new Variable("y"))),
+			BinaryOperation::MINUS,
+			new BinaryOperation(new Variable("y"), BinaryOperation::DIV,
+				new Let("z", new Variable("y"), new BinaryOperation(new Variable("z"), BinaryOperation::PLUS, new Variable("x"))))));
+	double const xs[] = { 1.0, 1.25, 1.5, 2.0 };
+	size_t const n = sizeof(xs) / sizeof(xs[0]);
+	double batch[n], streamed[n];
+	std::vector<double const*> columns(1, xs);
+	Program program = Compiler(SIZE_MAX).compile(expr);
+	program.run(columns, n, batch);
+	std::ostringstream buffer;
+	PostorderWriter(buffer).write(expr);
+	std::string const bytes = buffer.str();
+	MemorySource source(bytes.data(), bytes.size());
+	bool read = StreamEvaluator().evaluate(source, { { "x", xs } }, n, streamed);
+	FixedPointProgram fixed(program, { Interval{ 1.0, 2.0 } }, 32, FixedPointProgram::CHECKED);
+	bool evaluated = true, compiled = true, stream = read, fixedPoint = fixed.valid();
+	for (size_t i = 0; i < n; ++i) {
+		double y = xs[i] + 1.0, expected = 4.0 * y * y - y / (y + xs[i]);
+		Environment::bindings().emplace_back("x", xs[i]);
+		evaluated = evaluated && std::fabs(expr->evaluate() - expected) < 1e-12;
+		Environment::bindings().pop_back();
+		compiled = compiled && std::fabs(batch[i] - expected) < 1e-12;
+		stream = stream && std::fabs(streamed[i] - expected) < 1e-12;
+		int64_t in = int64_t(std::llround(std::ldexp(xs[i], 32))), out = 0;
+		fixedPoint = fixedPoint && fixed.evaluate(&in, out) && std::fabs(std::ldexp(double(out), -fixed.resultFrac()) - expected) < 1e-6;
+	}
+	delete expr;
+	bool ok = check("Let: shadowing in evaluate", evaluated);
+	ok = check("Let: shadowing in Program", compiled) && ok;
+	ok = check("Let: shadowing in FixedPointProgram", fixedPoint) && ok;
+	ok = check("Let: shadowing in StreamEvaluator", stream) && ok;
+
+	// x + sum(let t = arr * 2 in t * t + t): let внутри тела свёртки, снаружи — столбец
+	double const arr[] = { 1.0, 2.0, 3.0 };
+	Environment::arrays().push_back(Environment::Array{ "arr", arr, 3 });
+	Expression* reduced = new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Reduction(Reduction::SUM,
+		new Let("t", new BinaryOperation(new Variable("arr"), BinaryOperation::MUL, new Number(2.0)),
+			new BinaryOperation(new BinaryOperation(new Variable("t"), BinaryOperation::MUL, new Variable("t")), BinaryOperation::PLUS, new Variable("t")))));
+	Compiler().compile(reduced).run(columns, n, batch);
+	bool inside = true;
+	for (size_t i = 0; i < n; ++i) {
+		Environment::bindings().emplace_back("x", xs[i]);
+		inside = inside && reduced->evaluate() == xs[i] + 68.0 && batch[i] == xs[i] + 68.0;
+		Environment::bindings().pop_back();
+	}
+	Environment::arrays().pop_back();
+	delete reduced;
+	return check("Let: let inside a reduction body", inside) && ok;
+}
+
+bool testRegistry() { // определения на фоне поиска; встроенные функции реестр не трогают
+	std::atomic<int> bad(0);
+	std::vector<std::thread> threads;
+	threads.emplace_back([]() {
+		for (int i = 0; i < 200; ++i)
+			FunctionRegistry::instance().define("test_f" + std::to_string(i), { "u" },
+				new BinaryOperation(new Variable("u"), BinaryOperation::MUL, new Number(i)));
+	});
+	for (int t = 0; t < 3; ++t)
+		threads.emplace_back([&]() {
+			for (int i = 0; i < 2000; ++i) {
+				std::string name = "test_f" + std::to_string(i % 200);
+				if (FunctionRegistry::instance().find(name)) {
+					FunctionCall call(name, new Number(2.0));
+					if (call.evaluate() != 2.0 * (i % 200))
+						++bad;
+				}
+				FunctionCall builtin("sqrt", new Number(4.0));
+				if (builtin.evaluate() != 2.0)
+					++bad;
+			}
+		});
+	for (std::thread& thread : threads)
+		thread.join();
+	bool ok = check("FunctionRegistry: lookups during definitions", bad == 0 && FunctionRegistry::instance().find("test_f199"));
+
+	// Невстроенная функция вызывает другую невстроенную: ядра и их буферы переживают много блоков строк.
+	Expression* inner = new Variable("u");
+	for (int i = 0; i < 12; ++i)
+		inner = new BinaryOperation(new BinaryOperation(inner, BinaryOperation::MUL, new Number(0.5)), BinaryOperation::PLUS, new Variable("v"));
+	FunctionRegistry::instance().define("test_inner", { "u", "v" }, inner);
+	Expression* outer = new Variable("w");
+	for (int i = 0; i < 12; ++i)
+		outer = new BinaryOperation(outer, BinaryOperation::MINUS, new FunctionCall("test_inner", { new Variable("w"), new Number(i) }));
+	FunctionRegistry::instance().define("test_outer", { "w" }, outer);
+	Expression* expr = new BinaryOperation(new FunctionCall("test_outer", new Variable("x")), BinaryOperation::DIV,
+		new FunctionCall("test_inner", { new Variable("x"), new Number(3.0) }));
+	Program program = Compiler().compile(expr);
+	size_t const n = 3 * Program::BLOCK + 17;
+	std::vector<double> xs(n), out(n);
+	for (size_t i = 0; i < n; ++i)
+		xs[i] = double(i) * 0.25 - 40.0;
+	program.run(std::vector<double const*>(1, xs.data()), n, out.data());
+	bool same = program.functions.size() == 2;
+	for (size_t i = 0; i < n; ++i) {
+		Environment::bindings().emplace_back("x", xs[i]);
+		double expected = expr->evaluate();
+		Environment::bindings().pop_back();
+		same = same && (out[i] == expected || (out[i] != out[i] && expected != expected));
+	}
+	delete expr;
+	return check("Program: nested calls of shared kernels across blocks", same) && ok;
+}
+
+bool testReductions() {
+	std::vector<double> a(3, 1.0), b(1 << 16);
+	for (size_t i = 0; i < b.size(); ++i)
+		b[i] = double(i % 7);
+	double total = 0.0;
+	for (double v : b)
+		total += v;
+	Environment::arrays().push_back(Environment::Array{ "test_a", a.data(), a.size() });
+	Environment::arrays().push_back(Environment::Array{ "test_b", b.data(), b.size() });
+
+	Expression* perRow = new BinaryOperation(new Variable("x"), BinaryOperation::PLUS,
+		new Reduction(Reduction::SUM, new BinaryOperation(new Variable("test_a"), BinaryOperation::MUL, new Variable("x"))));
+	Program rejected;
+	bool ok = check("reductions: body over columns rejected in batch", !Compiler().compile(perRow, CompileLimits(), rejected));
+	delete perRow;
+
+	Expression* f = new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Reduction(Reduction::SUM, new Variable("test_b")));
+	MonteCarlo monteCarlo(f);
+	monteCarlo.bind("x", Distribution{ Distribution::CONSTANT, 1.0, 0.0 });
+	ok = check("reductions: MonteCarlo workers", monteCarlo.run(100000, 1, 4).mean == 1.0 + total) && ok;
+	std::vector<double> xs(1000, 2.0), target(1000, 2.0 + total);
+	std::vector<double const*> columns(1, xs.data());
+	FitnessEvaluator fitness({ "x" }, columns, target.data(), 1000);
+	ok = check("reductions: FitnessEvaluator workers", fitness.evaluate({ f }, 1e300, 4)[0] == 0.0) && ok;
+
+	// Вложенная свёртка в теле и DOT: тела идут блоками по одному Scratch, вложенное значение считается один раз.
+	Expression* nested = new Reduction(Reduction::SUM, new BinaryOperation(new Variable("test_b"), BinaryOperation::MUL,
+		new Reduction(Reduction::MAX, new BinaryOperation(new Variable("test_a"), BinaryOperation::PLUS, new Number(1.0)))));
+	Expression* dot = new Reduction(Reduction::DOT, new Variable("test_b"), new BinaryOperation(new Variable("test_b"), BinaryOperation::MINUS, new Number(1.0)));
+	double squares = 0.0;
+	for (double v : b)
+		squares += v * (v - 1.0);
+	ok = check("reductions: nested reduction and DOT over many blocks", nested->evaluate() == 2.0 * total && dot->evaluate() == squares) && ok;
+	delete nested;
+	delete dot;
+	delete f;
+
+	Expression* g = new BinaryOperation(new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Variable("x")),
+		BinaryOperation::MINUS, new Reduction(Reduction::MAX, new Variable("test_b")));
+	NewtonSolver solver(g, "x");
+	double guess = 0.0, lo = 0.0, hi = 10.0, root = 0.0;
+	size_t converged = solver.solve({}, &guess, &lo, &hi, 1, &root);
+	ok = check("differentiate: max without assert, Newton converges", converged == 1 && std::fabs(root - std::sqrt(6.0)) < 1e-9) && ok;
+	delete g;
+	Environment::arrays().resize(Environment::arrays().size() - 2);
+	return ok;
+}
+
+bool testTable() {
+	bool ok = true;
+	for (int interpolation : { Table::LINEAR, Table::CUBIC })
+		for (bool uniform : { true, false }) {
+			Table table(uniform ? std::vector<double>{ 0, 1, 2, 3 } : std::vector<double>{ 0, 1, 2.5, 3 }, { 7, 1, 2, 3 }, interpolation);
+			ok = ok && std::isnan(table.evaluate(NAN)) && std::isnan(table.derivative()->evaluate(NAN)) && table.evaluate(-5.0) == 7.0;
+		}
+	ok = check("Table: NaN argument gives NaN", ok);
+
+	// Имя t' занять нельзя: производная t(2x) всегда берёт таблицу производной t.
+	FunctionRegistry& registry = FunctionRegistry::instance();
+	auto table = std::make_shared<Table const>(std::vector<double>{ 0, 1, 2, 3 }, std::vector<double>{ 0, 1, 4, 9 }, Table::CUBIC);
+	Expression* impostor = new Number(42.0);
+	bool reserved = registry.defineTable("test_t", table) && !registry.define("test_t'", { "u" }, impostor)
+		&& !registry.defineTable("test_t'", std::make_shared<Table const>(std::vector<double>{ 0, 1 }, std::vector<double>{ 42, 42 }, Table::LINEAR));
+	delete impostor;
+	Expression* expr = new FunctionCall("test_t", new BinaryOperation(new Number(2.0), BinaryOperation::MUL, new Variable("x")));
+	Differentiate differentiate("x");
+	Expression* first = expr->transform(&differentiate);
+	Expression* second = first->transform(&differentiate);
+	Environment::bindings().emplace_back("x", 0.7);
+	double slope = first->evaluate(), curvature = second->evaluate();
+	Environment::bindings().pop_back();
+	bool derivative = slope == 2.0 * table->derivative()->evaluate(1.4) && curvature == 4.0 * table->derivative()->derivative()->evaluate(1.4)
+		&& registry.find("test_t'") && registry.find("test_t''");
+	delete expr;
+	delete first;
+	delete second;
+	return check("Table: derivative names are reserved and always this table's", reserved && derivative) && ok;
+}
+
+struct Plain : Number { // узел без памяти вне себя: область забывает его без деструктора
+	static int& destroyed() {
+		static int destroyed = 0;
+		return destroyed;
+	}
+	explicit Plain(double value) : Number(value) { track(); }
+	~Plain() { ++destroyed(); }
+};
+bool testRequestScope() {
+	bool nested = true;
+	for (int i = 0; i < 1000; ++i) {
+		RequestScope scope;
+		Expression* tree = new BinaryOperation(new Probe(i), BinaryOperation::PLUS,
+			new FunctionCall("sqrt", new BinaryOperation(new Probe(1.0), BinaryOperation::MUL, new Variable("a_long_enough_variable_name"))));
+		CopySyntaxTree copy;
+		FoldConstants fold;
+		Expression* copied = tree->transform(&copy);
+		delete copied->transform(&fold); // явное удаление внутри области
+		if (i % 2) {
+			RequestScope inner;
+			delete new BinaryOperation(new Probe(2.0), BinaryOperation::MINUS, new Probe(3.0));
+			new Probe(4.0);
+		}
+		nested = nested && Probe::alive() == 2;
+	}
+	Expression* heap = new BinaryOperation(new Probe(1.0), BinaryOperation::PLUS, new Probe(2.0));
+	bool outside = Probe::alive() == 2;
+	delete heap;
+	bool ok = check("RequestScope: destructors run on rewind", nested && outside && Probe::alive() == 0);
+
+	Expression* early = new Probe(5.0); // поддерево из кучи переходит к узлу области
+	{
+		RequestScope scope;
+		for (int i = 0; i < 1000; ++i)
+			new BinaryOperation(new Plain(i), BinaryOperation::PLUS, new Plain(1.0));
+		delete new Plain(2.0);
+		new BinaryOperation(early, BinaryOperation::MUL, new Plain(3.0));
+	}
+	return check("RequestScope: only nodes with heap memory are destroyed", Plain::destroyed() == 1 && Probe::alive() == 0) && ok;
+}
+
+bool testScopedDefinition() { // тело функции, построенное в области, переживает её
+	{
+		RequestScope scope;
+		Expression* body = new BinaryOperation(new Variable("u"), BinaryOperation::MUL, new Variable("u"));
+		FunctionRegistry::instance().define("test_scoped_square", { "u" }, body);
+		Expression* loose = new Variable("u");
+		bool refused = !FunctionRegistry::instance().define("test_scoped_square", { "u" }, loose); // body остаётся области
+		if (!refused)
+			return check("RequestScope: define copies the body to the heap", false);
+		new Probe(1.0);
+	}
+	{
+		RequestScope scope; // новый запрос занимает ту же память арены
+		for (int i = 0; i < 100; ++i)
+			new BinaryOperation(new Number(99.0), BinaryOperation::PLUS, new Number(99.0));
+	}
+	FunctionRegistry::Definition const* definition = FunctionRegistry::instance().find("test_scoped_square");
+	FunctionCall call("test_scoped_square", new Number(3.0));
+	Program program = Compiler(0).compile(&call);
+	double out = 0.0;
+	program.run({}, 1, &out);
+	return check("RequestScope: define copies the body to the heap", definition && !RequestScope::arena().owns(definition->body)
+		&& call.evaluate() == 9.0 && out == 9.0 && Probe::alive() == 0);
+}
+
+bool testParallelBatch() { // строки и детерминированная сумма не зависят от числа потоков
+	std::vector<double> b(1 << 16);
+	double total = 0.0;
+	for (size_t i = 0; i < b.size(); ++i)
+		total += b[i] = double(i % 7);
+	Environment::arrays().push_back(Environment::Array{ "test_b", b.data(), b.size() });
+	Expression* f = new BinaryOperation(new Variable("x"), BinaryOperation::PLUS, new Reduction(Reduction::SUM, new Variable("test_b")));
+	size_t const n = size_t(1) << 20;
+	std::vector<double> x(n);
+	for (size_t i = 0; i < n; ++i)
+		x[i] = 1.0 / double(1 + i % 1000); // слагаемые не точны: сумма зависит от порядка сложения
+	Program program = Compiler().compile(f);
+	std::vector<double const*> column(1, x.data());
+	std::vector<double> expected(n), out(n);
+	program.run(column, n, expected.data());
+	bool rows = true, sums = true;
+	double reference = 0.0;
+	for (unsigned threads = 1; threads <= 8; ++threads) {
+		ParallelBatch batch(program, ParallelBatch::DETERMINISTIC, threads);
+		batch.run(column, n, out.data());
+		double sum = batch.sum(column, n);
+		rows = rows && out == expected && expected[1] == 0.5 + total;
+		sums = sums && (threads == 1 || sum == reference);
+		reference = sum;
+	}
+	bool ok = check("ParallelBatch: rows with reductions, 1-8 threads", rows);
+	ok = check("ParallelBatch: deterministic sum, 1-8 threads", sums) && ok;
+	delete f;
+	Environment::arrays().pop_back();
+	return ok;
+}
+
+bool testLimits() { // бюджет недоверенной формулы и отмена пакетного вычисления
+	Random random(7);
+	Expression* tree = balancedTree(6, random);
+	size_t nodes = Population::size(tree), depth = treeDepth(tree);
+	Cost cost = Cost::estimate(tree);
+	CompileLimits small;
+	small.nodes = nodes - 1;
+	CompileLimits shallow;
+	shallow.depth = depth - 1;
+	Program program;
+	Cost rejected;
+	bool ok = check("Cost: nodes and depth of a tree", cost.nodes == nodes && cost.depth == depth && cost.operations >= double(nodes));
+	ok = check("CompileLimits: too many nodes or too deep rejected", !Compiler().compile(tree, small, program, &rejected)
+		&& !rejected.within(small) && !Compiler().compile(tree, shallow, program) && Compiler().compile(tree, CompileLimits(), program)) && ok;
+	delete tree;
+
+	double const arr[] = { 1.0, 2.0, 3.0 };
+	Environment::arrays().push_back(Environment::Array{ "test_arr", arr, 3 });
+	Expression* reduced = new Reduction(Reduction::SUM, new BinaryOperation(new Variable("test_arr"), BinaryOperation::MUL, new Variable("test_arr")));
+	CompileLimits budget;
+	budget.operations = 1000.0;
+	budget.elements = 100;
+	bool cheap = Compiler().compile(reduced, budget, program);
+	budget.elements = 1000; // тело идёт по разу на элемент
+	ok = check("CompileLimits: reduction cost grows with elements", cheap && !Compiler().compile(reduced, budget, program)) && ok;
+	delete reduced;
+	// let y = 2 in sum(test_arr * y): ячейка let свёртке не видна, поэтому пакетная программа отклоняется
+	Expression* hidden = new Let("y", new Number(2.0),
+		new Reduction(Reduction::SUM, new BinaryOperation(new Variable("test_arr"), BinaryOperation::MUL, new Variable("y"))));
+	ok = check("CompileLimits: reduction reading a let rejected, evaluate still works",
+		hidden->evaluate() == 12.0 && !Compiler().compile(hidden, CompileLimits(), program)) && ok;
+	delete hidden;
+	Environment::arrays().pop_back();
+
+	Expression* f = new BinaryOperation(new Variable("x"), BinaryOperation::MUL, new Number(3.0));
+	Program linear = Compiler().compile(f);
+	delete f;
+	size_t const n = 1 << 20;
+	std::vector<double> x(n, 1.0), out(n, 0.0), full(n, 0.0);
+	std::vector<double const*> columns(1, x.data());
+	ParallelBatch batch(linear, ParallelBatch::DETERMINISTIC, 4);
+	CancellationToken cancelled, expired(std::chrono::steady_clock::duration::zero()), open;
+	cancelled.cancel();
+	double total = -1.0;
+	bool stopped = !batch.run(columns, n, out.data(), &cancelled) && !batch.sum(columns, n, total, &expired)
+		&& std::count(out.begin(), out.end(), 3.0) == 0;
+	bool finished = batch.run(columns, n, full.data(), &open) && batch.sum(columns, n, total, &open)
+		&& total == 3.0 * n && std::count(full.begin(), full.end(), 3.0) == std::ptrdiff_t(n);
+	return check("CancellationToken: cancelled or expired stops, open finishes", stopped && finished && !open.stopped()) && ok;
+}
+
+bool testResultCache() {
+	Expression* x = new Variable("x");
+	Expression* twice = new BinaryOperation(x, BinaryOperation::MUL, new Number(2.0));
+	uint64_t fingerprint = ResultCache::fingerprint(twice);
+	ResultCache cache(16);
+	bool values = cache.evaluate(twice, fingerprint, { { "x", 4.0 } }) == 8.0 && cache.evaluate(twice, fingerprint, { { "x", 4.0 } }) == 8.0;
+	for (int i = 0; i < 100; ++i)
+		cache.evaluate(twice, fingerprint, { { "x", double(i) } });
+	bool ok = check("ResultCache: hits and LRU bound", values && cache.hits() >= 1 && cache.size() <= 16 && cache.evictions() > 0);
+
+	ResultCache shared(1024);
+	std::atomic<int> bad(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t)
+		threads.emplace_back([&]() {
+			for (int i = 0; i < 10000; ++i)
+				if (shared.evaluate(twice, fingerprint, { { "x", double(i % 100) } }) != 2.0 * (i % 100))
+					++bad;
+		});
+	for (std::thread& thread : threads)
+		thread.join();
+	ok = check("ResultCache: concurrent lookups", bad == 0 && shared.misses() >= 100 && shared.hits() + shared.misses() == 40000) && ok;
+
+	ResultCache expiring(16, std::chrono::steady_clock::duration::zero());
+	expiring.evaluate(twice, fingerprint, { { "x", 1.0 } });
+	expiring.evaluate(twice, fingerprint, { { "x", 1.0 } });
+	ResultCache coarse(16, std::chrono::steady_clock::duration::max(), 0.5); // близкие входы делят результат первого
+	bool quantized = coarse.evaluate(twice, fingerprint, { { "x", 4.0 } }) == 8.0 && coarse.evaluate(twice, fingerprint, { { "x", 4.1 } }) == 8.0
+		&& coarse.evaluate(twice, fingerprint, { { "x", 5.0 } }) == 10.0;
+	ok = check("ResultCache: ttl expires, quantum groups inputs", expiring.hits() == 0 && expiring.evictions() == 1 && quantized && coarse.hits() == 1) && ok;
+	delete twice;
+	return ok;
+}
+
+bool testTiledBatch() {
+	Random random(3);
+	std::vector<std::string> names{ "a", "b", "c" };
+	size_t const n = 1000;
+	std::vector<std::vector<double>> data(names.size(), std::vector<double>(n));
+	std::vector<double const*> columns;
+	for (std::vector<double>& column : data) {
+		for (double& v : column)
+			v = random.uniform();
+		columns.push_back(column.data());
+	}
+	Compiler compiler;
+	std::vector<Program> programs;
+	for (int i = 0; i < 5; ++i) {
+		Expression* expr = columnFormula(3, names, random);
+		programs.push_back(compiler.compile(expr));
+		delete expr;
+	}
+	std::vector<Program const*> pointers;
+	std::vector<std::vector<double>> results(programs.size(), std::vector<double>(n));
+	std::vector<double*> outs;
+	for (size_t i = 0; i < programs.size(); ++i) {
+		pointers.push_back(&programs[i]);
+		outs.push_back(results[i].data());
+	}
+	TiledBatch batch(pointers, names);
+	bool ok = true;
+	for (size_t tile : { size_t(1), size_t(300), size_t(4096) }) { // неполный последний кусок и кусок больше n
+		batch.setTile(tile);
+		batch.run(columns, n, outs);
+		for (size_t i = 0; i < programs.size(); ++i) {
+			std::vector<double const*> own;
+			for (std::string const& name : programs[i].variables)
+				own.push_back(columns[std::find(names.begin(), names.end(), name) - names.begin()]);
+			std::vector<double> expected(n);
+			programs[i].run(own, n, expected.data());
+			ok = ok && expected == results[i];
+		}
+	}
+	return check("TiledBatch: matches formula by formula for tiles 1, 300, 4096", ok);
+}
+
+bool same(double a, double b) { // NaN разного знака считаются равными
+	return a == b || (a != a && b != b);
+}
+bool testTaskGraph() {
+	bool ok = true;
+	for (uint64_t seed = 1; seed <= 10; ++seed) {
+		Random random(seed);
+		Expression* body = new BinaryOperation(balancedTree(14, random), BinaryOperation::PLUS, new Variable("x"));
+		Expression* tree = new BinaryOperation(new Let("x", balancedTree(13, random), body),
+			BinaryOperation::MUL, new FunctionCall("sqrt", balancedTree(14, random)));
+		PackedTree packed(tree);
+		delete tree;
+		packed.relayout(int(seed % 3));
+		std::vector<double> values(packed.symbols().size(), 0.25);
+		double expected = packed.evaluate(values);
+		for (unsigned threads : { 2u, 3u, 4u, 8u })
+			ok = ok && same(TaskGraph(packed, threads).evaluate(values), expected);
+	}
+	return check("TaskGraph: matches PackedTree, 2-8 threads", ok);
+}
+
+bool runTests() {
+	bool ok = true;
+	ok = testDoubleDouble() && ok;
+	ok = testFixedPoint() && ok;
+	ok = testNewton() && ok;
+	ok = testMonteCarlo() && ok;
+	ok = testPopulation() && ok;
+	ok = testCompileCache() && ok;
+	ok = testFormulaPack() && ok;
+	ok = testMetrics() && ok;
+	ok = testStream() && ok;
+	ok = testCorpus() && ok;
+	ok = testFormulaLibrary() && ok;
+	ok = testLet() && ok;
+	ok = testRegistry() && ok;
+	ok = testReductions() && ok;
+	ok = testTable() && ok;
+	ok = testRequestScope() && ok;
+	ok = testScopedDefinition() && ok;
+	ok = testParallelBatch() && ok;
+	ok = testLimits() && ok;
+	ok = testResultCache() && ok;
+	ok = testTiledBatch() && ok;
+	ok = testTaskGraph() && ok;
+	std::cout << (ok ? "all checks passed" : "some checks FAILED") << std::endl;
+	return ok;
+}
+
+
+int main(int argc, char** argv) {
+	if (argc > 1 && std::string(argv[1]) == "--bench") { // замеры вместо демонстрации
+		runBenchmarks();
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--test") // самопроверка; код возврата 1 при ошибке
+		return runTests() ? 0 : 1;
 	/*
 		//------------------------------------------------------------------------------
 		Expression* e1 = new Number(1.234);